@@ -1,4 +1,5 @@
 
+#define _GNU_SOURCE // for mremap
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -7,6 +8,15 @@
 #include <assert.h>
 #include <stddef.h>
 #include <limits.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "mm.h"
 #include "memlib.h"
@@ -44,13 +54,232 @@
 #define dbg_ensures(...)
 #endif
 
+/*
+ * If MM_THREADS is defined, the allocator may be called from several threads
+ * at once. Threads are spread over up to MAX_ARENAS independent arenas, each
+ * with its own free lists and lock, and every thread keeps a small cache of
+ * recently freed blocks per exact size class that it can reuse without
+ * locking. Without MM_THREADS there is one arena and no locking at all.
+ */
+// #define MM_THREADS // uncomment this line to build the thread-safe allocator
+
+/*
+ * If MM_STATS is defined, the allocator counts what it does: calls, bytes
+ * handed out and returned, heap growth, mappings, coalescing cases, in-place
+ * and copying reallocs, and histograms of fit-scan lengths and request
+ * sizes; mm_stats prints them. Without it, the counting helpers are empty
+ * and mm_stats only reports what a walk of the heap shows.
+ */
+// #define MM_STATS // uncomment this line to compile in the counters
+
+/*
+ * If MM_PROFILE is defined, mm_profile_rate turns on a sampling heap
+ * profiler. Each thread samples one allocation about every rate bytes, at
+ * geometrically distributed intervals so that every byte is equally likely
+ * to be picked, and records the stack that made it. free looks blocks up
+ * in the table of samples only while some are live. mm_profile_dump prints
+ * the live or cumulative bytes per stack as folded stacks, and
+ * mm_profile_dump_pprof in pprof's legacy heap format. Without MM_PROFILE
+ * the hooks are empty.
+ */
+// #define MM_PROFILE // uncomment this line to compile in the profiler
+
+/*
+ * If MM_POLICY is defined, as an initializer for mm_policy_t, it fixes the
+ * placement policy at build time: the policy becomes a constant, the tests
+ * on it fold away, and mm_set_policy refuses to change it. For example,
+ *     -DMM_POLICY='{MM_FIT_GOOD, MM_INSERT_ADDRESS, 16, 3, 64, 4096, 1 << 20}'
+ * Without it, the policy is POLICY_DEFAULT until mm_set_policy changes it.
+ */
+// #define MM_POLICY POLICY_DEFAULT // uncomment this line to fix the policy
+
+/*
+ * If MM_HUGEPAGES is defined, heaps are laid out for transparent huge pages:
+ * a heap always grows up to the next huge_page boundary, each stretch it
+ * grows by is marked with madvise(MADV_HUGEPAGE), and free memory goes back
+ * to the OS only in whole huge pages, so that trimming never splits one that
+ * is partly in use. mm_hugepages reports how many huge pages back the heaps
+ * either way, so that the two builds can be compared.
+ */
+// #define MM_HUGEPAGES // uncomment this line to grow heaps in huge pages
+
+#ifdef MM_THREADS
+#include <pthread.h>
+#endif
+
+#ifdef MM_PROFILE
+#include <dlfcn.h>
+#include <execinfo.h>
+#endif
+
 /* Basic constants */
 typedef uint64_t word_t;
 static const size_t wsize = sizeof(word_t);     // word, header, footer size (bytes)
 static const size_t dsize = 2 * wsize;          // double word size (bytes)
-static const size_t min_block_size = 2 * dsize; // Minimum block size
+static const size_t min_block_size = dsize;     // Minimum (mini) block size
 static const size_t chunksize = (1 << 11);      // requires (chunksize % 16 == 0)
 
+/*
+ * Segregated free lists: sizes up to seg_exact_max each get their own exact
+ * class (one list per multiple of dsize), sizes up to seg_range_max are
+ * grouped into power-of-two ranges. The last class is not a list but a
+ * red-black tree keyed by size, which holds every larger block and gives a
+ * true best fit in O(log n); blocks of equal size hang off a single node.
+ * A bit per class in seg_bitmap records which classes are nonempty, so the
+ * first usable class is found with a single count-trailing-zeros.
+ */
+#define SEG_CLASSES 36                          // at most one bit per class in a word
+static const size_t seg_exact_max = 512;        // largest exact size class
+static const size_t seg_exact_count = 32;       // (512 - 16) / 16 + 1 classes
+static const int seg_exact_log = 9;             // log2(seg_exact_max)
+static const size_t seg_range_max = 4096;       // largest size kept in a list
+static const size_t tree_class = SEG_CLASSES - 1;
+
+/*
+ * Each range class also has a packed index of its blocks, their sizes in
+ * one array and their links in another, so that find_fit compares a whole
+ * class's sizes with a few vector instructions instead of chasing next
+ * links across the heap. A block's slot in the index is kept in its left
+ * field, which only tree blocks otherwise use. Blocks filed while the index
+ * is full are left out of it, marked fit_unindexed, and only the list scan
+ * finds them.
+ */
+#define SEG_RANGES 3                            // classes between exact and tree
+#define FIT_INDEX_CAP 256                       // entries per index, a multiple of 8
+static const uint32_t fit_unindexed = UINT32_MAX;
+
+/*
+ * Placement policy: how find_fit picks among the blocks of a range class,
+ * where add files a block in its list, the least remainder place splits
+ * off, and the bounds of the adaptive heap growth. Exact classes hold
+ * blocks of one size, and the tree always gives the best fit, so the fit
+ * policy only matters in between; only the best and good fits use the
+ * packed index, which is not kept up otherwise. The default is an
+ * address-ordered best fit over LIFO lists, as described above.
+ */
+#define POLICY_DEFAULT {MM_FIT_BEST, MM_INSERT_LIFO, 16, 3, 16, 2048, 65536}
+#ifdef MM_POLICY
+static const mm_policy_t policy = MM_POLICY;
+#else
+static mm_policy_t policy = POLICY_DEFAULT;
+static mm_policy_t policy_next = POLICY_DEFAULT; // mm_init makes it current
+#endif
+
+/* Colors of tree nodes; tree_dup marks a block in a node's equal-size list */
+static const uint32_t tree_red = 0;
+static const uint32_t tree_black = 1;
+static const uint32_t tree_dup = 2;
+
+/*
+ * Requests of at least mmap_threshold bytes bypass the heap: each gets its
+ * own mapping, marked by mapped_bit in its header, which free unmaps right
+ * away and realloc resizes with mremap. The word before the header holds
+ * the distance from the start of the mapping to the header.
+ */
+static const word_t mapped_bit = 0x4;
+
+/*
+ * Free-list links are 32-bit offsets, in dsize units, from the word before
+ * the arena's prologue footer, so that a free block needs only one word for
+ * both links. They are biased by link_bias, which reaches blocks on either
+ * side of the prologue, and 0 stays free for NULL. A 16-byte mini block
+ * (header plus links) has no room for a footer; instead, prev_mini_bit in
+ * the next block's header says that the block before it is a mini block.
+ * The offsets bound the size of a heap and how far its segments may lie.
+ */
+static const word_t prev_mini_bit = 0x8;
+static const ptrdiff_t link_bias = (ptrdiff_t)1 << 31; // link of the offset 0
+static const size_t max_heap_span = (size_t)INT32_MAX * dsize;
+static size_t mmap_threshold = (1 << 17); // tunable with mm_set_mmap_threshold
+
+/*
+ * Free memory is given back to the OS in pages. Whenever a free leaves a
+ * coalesced block of at least trim_threshold bytes, the pages of the freed
+ * range inside it are released with madvise; header, links and footer stay
+ * put. An extra arena whose last block becomes that large also lowers its
+ * break, keeping top_pad bytes. mm_trim does the same for the whole heap.
+ */
+static size_t trim_threshold = (1 << 17); // tunable with mm_set_trim_threshold
+static const size_t top_pad = (1 << 16);  // kept at the end of an extra arena
+static const size_t huge_page = (1 << 21); // transparent huge page size
+
+/*
+ * An arena whose heap can grow no further, because mem_sbrk fails or an
+ * extra arena has filled its reservation, maps a segment: segment_size
+ * bytes aligned to their size, starting with a segment_t and laid out after
+ * it like a heap of their own, prologue footer, blocks and epilogue header,
+ * so that coalescing never crosses a segment's edges. The arena that owns a
+ * block outside the main heap is found by masking its address; an extra
+ * arena's reservation starts with a segment_t for that reason too. A
+ * segment whose blocks all become free again is unmapped.
+ */
+static const size_t segment_size = (1 << 26); // power of two
+
+/*
+ * With deferred frees (mm_set_deferred_free, or mm_maintain_thread), free
+ * neither locks nor coalesces: it pushes the block, still marked allocated,
+ * onto its arena's pending stack, chained through its first payload word.
+ * mm_maintain, or a maintenance thread that calls it on a timer, merges
+ * pending blocks maint_batch at a time under the arena's lock, releasing
+ * their pages as free would, and then refills the packed fit indexes. An
+ * arena that runs short merges its own pending blocks before it grows.
+ */
+static const size_t maint_batch = 64; // blocks merged per lock hold
+
+/*
+ * Free memory past the clean mark must read as zero. The checkers scan at
+ * most this many bytes of each such block, and of the memory an extra arena
+ * has given back above its break, so that a huge fresh block costs no more
+ * than any other; mm_set_deep_check makes mm_checkheap scan all of it.
+ */
+static const size_t step_scan_limit = 512;
+static bool deep_check = false; // set with mm_set_deep_check
+
+/*
+ * calloc only clears memory that may hold data. Each arena keeps a clean
+ * mark: heap memory past it has never been handed out and reads as zero,
+ * apart from the headers, links and footers of the free blocks there, which
+ * are zeroed again whenever such a block is merged away. Allocations move
+ * the mark up past the blocks they return. Fresh mappings are always zero;
+ * the main heap's fresh memory is zero only if mem_sbrk promises it.
+ */
+static const bool sbrk_zeroes = true; // mem_sbrk returns zero-filled memory
+
+/*
+ * Requests of up to slab_max bytes are served from slabs: runs of
+ * slab_run_size bytes, aligned to their size, each holding equal-size slots.
+ * Slots carry no header. All runs come from one reserved region, so free
+ * recognizes a slot by its address. Each run's header, with the bitmap of
+ * its free slots, lives in a table right after the region, indexed by the
+ * run's place in it, so that an empty run's whole page can be released.
+ */
+#define SLAB_CLASSES 4                              // 16, 32, 48 and 64 byte slots
+static const size_t slab_max = 64;                  // largest slab request
+static const size_t slab_run_size = (1 << 12);      // power of two
+static const size_t slab_region_size = (1 << 30);   // reservation for all runs
+
+/*
+ * Blocks allocated through handles (mm_halloc) may be moved by mm_compact.
+ * The handles themselves never move: they are carved out of one reserved
+ * region, so a handle is recognized by its address, and freed handles are
+ * chained for reuse.
+ */
+static const size_t handle_region_size = (1 << 26); // reservation for all handles
+
+/*
+ * A region (mm_region_create) bump-allocates objects out of chunks it gets
+ * from malloc and gives them all back at once. Chunks start at
+ * region_chunk_min bytes and double up to region_chunk_max; an object
+ * larger than a quarter of the next chunk gets a chunk of its own.
+ */
+static const size_t region_chunk_min = (1 << 14);
+static const size_t region_chunk_max = (1 << 20);
+
+#ifdef MM_THREADS
+#define MAX_ARENAS 16                  // upper bound on arenas
+#endif
+static const unsigned tcache_fill = 7; // blocks cached per class and thread
+
 typedef struct block
 {
     /* Header contains size + allocation flag */
@@ -64,8 +293,15 @@ typedef struct block
     {
         struct
         {
-            struct block *prev;
-            struct block *next;
+            /* Free-list links, as heap-relative offsets (0 for none) */
+            uint32_t prev;
+            uint32_t next;
+            /* Size-tree links and color, used only by blocks in the tree.
+             * A node's next heads its list of equal-size blocks. */
+            uint32_t left;
+            uint32_t right;
+            uint32_t parent;
+            uint32_t color;
         };
         char payload[0];
     };
@@ -76,21 +312,373 @@ typedef struct block
      */
 } block_t;
 
+/*
+ * Header of a slab run, kept in the table after the slab region. The run's
+ * slots fill its page from the start.
+ */
+typedef struct slab
+{
+    /* Neighbors in the arena's list of runs with free slots, or of empty runs */
+    struct slab *prev;
+    struct slab *next;
+    /* Arena that owns the run */
+    struct arena *arena;
+    /* Slot size in bytes, number of slots, and how many of them are free */
+    uint32_t slot_size;
+    uint16_t nslots;
+    uint16_t nfree;
+    /* Bit i is set when slot i is free */
+    uint64_t free_map[4];
+} slab_t;
+
+/*
+ * An arena is an independent heap with its own free lists. The main arena
+ * grows through mem_sbrk; every other arena lives in a reservation of
+ * segment_size bytes aligned to its own size, with a segment_t and the
+ * arena_t itself at the start, so the arena that owns a block is found by
+ * masking its address. Segments an arena maps when it cannot grow are
+ * chained off it.
+ */
+typedef struct arena
+{
+    /* Heads of the segregated free lists, one per size class; the last
+     * one is the root of the size tree */
+    block_t *seg_lists[SEG_CLASSES];
+    /* Last block of each list, where MM_INSERT_FIFO files blocks */
+    block_t *seg_tails[SEG_CLASSES];
+    /* Bit i is set when seg_lists[i] is nonempty */
+    uint64_t seg_bitmap;
+    /* Packed index of each range class: sizes (zero past the last entry),
+     * links, number of entries, and blocks of the class left out */
+    uint16_t fit_sizes[SEG_RANGES][FIT_INDEX_CAP];
+    uint32_t fit_links[SEG_RANGES][FIT_INDEX_CAP];
+    uint32_t fit_count[SEG_RANGES];
+    uint32_t fit_spill[SEG_RANGES];
+    /* Where MM_FIT_NEXT resumes in each range class, 0 for the head */
+    uint32_t fit_rover[SEG_RANGES];
+    /* Slab runs with free slots, one list per slab class, and empty runs */
+    slab_t *slabs[SLAB_CLASSES];
+    slab_t *slab_empty;
+    /* First block of the heap */
+    block_t *heap_start;
+    /* Prologue footer, current end of the heap, and end of the reservation
+     * (NULL for the main arena, which is bounded by mem_sbrk instead) */
+    char *heap_lo;
+    char *heap_brk;
+    char *heap_end;
+    /* Clean mark: memory from here up is zero but for free-block tags */
+    char *heap_clean;
+    /* Highest the break has been, which an extra arena may have lowered */
+    char *heap_top;
+    /* Last block mm_checkheap_step looked at, or NULL to start over */
+    block_t *check_at;
+    /* Wilderness: the free block before the epilogue, if there is one. It
+     * is kept off the free lists and used only when nothing on them fits */
+    block_t *wild;
+    /* Least amount the heap grows by next time, the policy's grow_min to
+     * grow_max */
+    size_t chunk;
+    /* Segments mapped since the heap stopped growing, newest first */
+    struct segment *segments;
+    /* Deferred frees: pushed by free without the lock, and those taken off
+     * that stack that are still to be merged */
+    block_t *pending;
+    block_t *merging;
+#ifdef MM_THREADS
+    pthread_mutex_t lock;
+#endif
+} arena_t;
+
+/*
+ * The start of a segment. Its blocks begin after the prologue footer that
+ * follows it, and the epilogue header is its last word. Memory from the
+ * clean mark up is zero but for free-block tags, as in an arena's heap.
+ * In an extra arena's own reservation only the arena is set.
+ */
+typedef struct segment
+{
+    arena_t *arena;
+    struct segment *next;
+    struct segment *prev;
+    block_t *start;
+    char *clean;
+} segment_t;
+
+/*
+ * Per-thread cache of freed blocks, one LIFO list per exact size class.
+ * Cached blocks stay marked allocated in the heap and are chained through
+ * the first word of their payload; only blocks of the thread's own arena
+ * are cached. Without MM_THREADS there is a single cache, whose bins only
+ * mm_free_sized fills.
+ */
+typedef struct tcache
+{
+    block_t *bins[SEG_CLASSES];
+    unsigned counts[SEG_CLASSES];
+    /* Freed slab slots, chained through their first word */
+    void *slots[SLAB_CLASSES];
+    unsigned slot_counts[SLAB_CLASSES];
+    arena_t *arena;
+} tcache_t;
+
+/*
+ * A handle refers to a movable block. ptr is the block's payload, whose
+ * first word points back to the handle (the caller's data starts dsize
+ * bytes in, to keep it aligned); once the handle is freed, ptr chains it
+ * to the next free handle instead. A block is only moved while its handle
+ * is not locked, and only under its arena's lock.
+ */
+typedef struct handle
+{
+    void *ptr;
+    /* Outstanding mm_hlock calls */
+    uint32_t locks;
+} handle_t;
+
+/*
+ * Every region chunk starts with a link to the chunk obtained before it.
+ * The region itself lives in its first chunk, right after the link, and
+ * records where the chunk being bumped through is full.
+ */
+typedef struct region_chunk
+{
+    struct region_chunk *next;
+    word_t pad; // keeps what follows 16-byte aligned
+} region_chunk_t;
+
+typedef struct region
+{
+    /* All chunks, newest first; the last one holds the region */
+    region_chunk_t *chunks;
+    /* Next free byte and end of the chunk being bumped through */
+    char *cur;
+    char *end;
+    /* End of the first chunk, and the size of the next one to get */
+    char *first_end;
+    size_t next_size;
+    word_t pad;
+} region_t;
+
 /* Global variables */
 /* Pointer to first block */
 static block_t *heap_listp = NULL;
-/* Pointer to the root of the linked list */
-block_t *root = NULL;
+/* The arena that grows through mem_sbrk */
+static arena_t main_arena;
+/* The slab region, the end of the part handed out as runs so far, and the
+ * table of run headers that follows it */
+static char *slab_lo = NULL;
+static char *slab_brk = NULL;
+static slab_t *slab_meta = NULL;
+/* Bytes held in direct mappings */
+static size_t mapped_bytes = 0;
+/* The handle region, the end of the part handed out so far, and the list
+ * of freed handles */
+static char *handle_lo = NULL;
+static char *handle_brk = NULL;
+static handle_t *handle_free = NULL;
+/* Whether free defers coalescing to mm_maintain */
+static bool defer_frees = false;
+
+#ifdef MM_THREADS
+/* All arenas; arenas[0] is the main arena, the rest are created on demand */
+static arena_t *arenas[MAX_ARENAS];
+static size_t arena_count = 1;
+/* Round-robin counter used to assign threads to arenas */
+static size_t next_arena = 0;
+/* Serializes initialization and arena creation */
+static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Guards the handle region and its list of freed handles */
+static pthread_mutex_t handle_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Flushes a thread's cache back to its arena when the thread exits */
+static pthread_key_t tcache_key;
+static bool tcache_key_made = false;
+static __thread tcache_t tcache;
+/* The maintenance thread, its period in microseconds, and the lock and
+ * condition it waits on, which also tell it to stop */
+static pthread_mutex_t maint_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t maint_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t maint_thread;
+static bool maint_running = false;
+static bool maint_stop = false;
+static size_t maint_interval = 0;
+#else
+/* Blocks freed with mm_free_sized, which malloc takes back by size */
+static tcache_t tcache;
+#endif
+
+/*
+ * Allocator counters, kept only with MM_STATS. Histograms have a bucket per
+ * power of two: bucket 0 counts zeros, bucket i values in [2^(i-1), 2^i),
+ * and the last bucket everything larger.
+ */
+#define STAT_BUCKETS 32
+typedef struct
+{
+    /* Calls; those realloc makes to malloc and free count too */
+    uint64_t malloc_calls;
+    uint64_t calloc_calls;
+    uint64_t realloc_calls;
+    uint64_t free_calls;
+    uint64_t memalign_calls;
+    /* Bytes of heap blocks and slab slots handed out and given back */
+    uint64_t alloc_bytes;
+    uint64_t freed_bytes;
+    /* Direct mappings made, removed and resized, and their bytes */
+    uint64_t maps;
+    uint64_t unmaps;
+    uint64_t remaps;
+    uint64_t map_bytes;
+    uint64_t unmap_bytes;
+    /* Heap growth, and pages given back to the OS */
+    uint64_t heap_grows;
+    uint64_t heap_grow_bytes;
+    uint64_t released_bytes;
+    /* How reallocs were served */
+    uint64_t realloc_in_place;
+    uint64_t realloc_remap;
+    uint64_t realloc_copy;
+    /* Coalesce cases 1-4: no, next, previous, or both neighbors free */
+    uint64_t coalesce_cases[4];
+    /* Allocations served by a thread cache */
+    uint64_t tcache_hits;
+    /* Blocks looked at per find_fit, and request sizes in bytes */
+    uint64_t fit_scan[STAT_BUCKETS];
+    uint64_t request_size[STAT_BUCKETS];
+} stats_t;
+
+static stats_t stats;
+
+#ifdef MM_PROFILE
+/*
+ * Sampled stacks, in an open-addressing table keyed by a hash of the
+ * stack, and live samples, keyed by address (linear probing, with
+ * deletion by shifting entries back, so no tombstones pile up). Both are
+ * fixed in size; samples that find no room are left out of the profile.
+ */
+#define PROFILE_DEPTH 32         // frames kept per stack
+#define PROFILE_SITES 4096       // power of two
+#define PROFILE_SAMPLES (1 << 16) // power of two
+typedef struct
+{
+    uint64_t hash; // 0 while unused
+    uint32_t depth;
+    void *pcs[PROFILE_DEPTH];
+    /* Every sample taken here, and those not yet freed: how many, their
+     * requested bytes, and the bytes they stand for */
+    uint64_t alloc_count, alloc_bytes, alloc_weight;
+    uint64_t live_count, live_bytes, live_weight;
+} site_t;
+
+typedef struct
+{
+    void *ptr; // NULL while unused
+    uint32_t site;
+    size_t size;
+    size_t weight;
+} sample_t;
+
+/* Per-thread sampling state */
+typedef struct
+{
+    size_t left;   // bytes until the next sample
+    uint64_t rng;  // xorshift state
+    bool busy;     // inside the profiler, which may allocate
+} profiler_t;
+
+static site_t profile_sites[PROFILE_SITES];
+static sample_t profile_samples[PROFILE_SAMPLES];
+static size_t profile_rate = 0; // mean bytes between samples; 0 when off
+static size_t profile_live = 0; // samples in profile_samples
+#ifdef MM_THREADS
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread profiler_t profiler;
+#else
+static profiler_t profiler;
+#endif
+#endif
 
 /* Function prototypes for internal helper routines */
-static block_t *extend_heap(size_t size);
-static void place(block_t *block, size_t asize);
-static block_t *find_fit(size_t asize);
-static block_t *coalesce(block_t *block);
+static void arena_setup(arena_t *a, word_t *start, char *end);
+static arena_t *arena_of(block_t *block);
+#ifdef MM_THREADS
+static arena_t *arena_at(size_t i);
+#endif
+static arena_t *thread_arena(void);
+static void arena_lock(arena_t *a);
+static void arena_unlock(arena_t *a);
+static void *arena_malloc(arena_t *a, size_t asize, size_t *dirty);
+static void *arena_memalign(arena_t *a, size_t align, size_t asize);
+static bool arena_malloc_batch(arena_t *a, size_t asize, size_t n, void **ptrs);
+static size_t mark_used(arena_t *a, block_t *block);
+static void arena_free(arena_t *a, block_t *block);
+static void *alloc_block(size_t size, size_t *dirty);
+static bool lazy_init(void);
+
+static void stat_add(uint64_t *counter, uint64_t n);
+static void stat_hist(uint64_t *hist, size_t value);
+static void stat_block(void *bp, bool alloc);
+static void stat_walk(arena_t *a, uint64_t totals[6]);
+static void count_mapped(size_t add, size_t sub);
+static inline __attribute__((always_inline)) void profile_alloc(void *bp, size_t size);
+static void profile_free(void *bp);
+static void profile_move(void *old, void *bp);
+#ifdef MM_PROFILE
+static size_t profile_interval(size_t rate);
+static bool profile_copy(size_t i, site_t *copy);
+static void profile_frame(FILE *stream, void *pc);
+#endif
+static void clear_tags(arena_t *a, block_t *block);
+static void merged(arena_t *a, block_t *block, block_t *into);
+static void pending_push(arena_t *a, block_t *block);
+static size_t pending_merge(arena_t *a, size_t limit);
+static size_t arena_maintain(arena_t *a, uint64_t deadline);
+static uint64_t now_us(void);
+
+static block_t *extend_heap(arena_t *a, size_t size);
+static char *segment_map(void);
+static block_t *segment_add(arena_t *a, size_t asize);
+static void segment_release(arena_t *a, segment_t *seg);
+static segment_t *segment_of(void *p);
+static block_t *next_part(arena_t *a, block_t *epilogue);
+static char **clean_mark(arena_t *a, void *p);
+static size_t heap_bytes(arena_t *a);
+static void place(arena_t *a, block_t *block, size_t asize);
+static block_t *find_fit(arena_t *a, size_t asize);
+static block_t *wild_fit(arena_t *a, size_t asize);
+static block_t *coalesce(arena_t *a, block_t *block);
+static void split_tail(arena_t *a, block_t *block, size_t asize);
+static bool grow_in_place(arena_t *a, block_t *block, size_t asize);
+
+static void *map_block(size_t size, size_t align);
+static void unmap_block(block_t *block);
+static void *remap_block(block_t *block, size_t size);
+static bool get_mapped(block_t *block);
+
+static size_t release_pages(char *lo, char *hi);
+static size_t heap_page(void);
+static bool heap_overlaps(uintptr_t lo, uintptr_t hi);
+static bool arena_overlaps(arena_t *a, uintptr_t lo, uintptr_t hi);
+static size_t smaps_huge_bytes(void);
+static size_t release_block(block_t *block, char *lo, char *hi);
+static size_t trim_top(arena_t *a, size_t pad);
+static size_t trim_arena(arena_t *a, size_t pad);
+
+static bool is_slab(void *bp);
+static slab_t *slab_of(void *bp);
+static char *slab_base(slab_t *run);
+static void *slab_malloc(arena_t *a, size_t size);
+static handle_t *handle_new(void);
+static void handle_release(handle_t *h);
+static bool is_movable(block_t *block);
+static block_t *slide_down(arena_t *a, block_t *block);
+static size_t compact_arena(arena_t *a);
+static void *region_grow(region_t *r, size_t size);
+static void slab_free(slab_t *run, void *bp);
 
 static size_t max(size_t x, size_t y);
+static size_t min(size_t x, size_t y);
 static size_t round_up(size_t size, size_t n);
-static word_t pack(size_t size, bool alloc, bool alloc_of_prev);
+static word_t pack(size_t size, bool alloc, bool alloc_of_prev, bool prev_mini);
 
 static size_t extract_size(word_t header);
 static size_t get_size(block_t *block);
@@ -99,7 +687,7 @@ static size_t get_payload_size(block_t *block);
 static bool extract_alloc(word_t header);
 static bool get_alloc(block_t *block);
 
-static void write_header(block_t *block, size_t size, bool alloc, bool alloc_of_prev);
+static void write_header(block_t *block, size_t size, bool alloc, bool alloc_of_prev, bool prev_mini);
 static void write_footer(block_t *block, size_t size, bool alloc);
 
 static block_t *payload_to_header(void *bp);
@@ -111,11 +699,64 @@ static block_t *find_prev(block_t *block);
 
 static void prev_make(block_t *block, bool al_prev);
 bool get_alloc_of_prev(block_t *block);
+static void prev_mini_make(block_t *block, bool mini);
+static bool get_prev_mini(block_t *block);
+
+static block_t *link_to_block(arena_t *a, uint32_t link);
+static uint32_t block_to_link(arena_t *a, block_t *block);
+
+static size_t size_class(size_t asize);
+static void add(arena_t *a, block_t *block_address);
+static void list_remove(arena_t *a, block_t *block_address);
+static void fit_index_add(arena_t *a, size_t range, block_t *block);
+static void fit_index_remove(arena_t *a, size_t range, block_t *block);
+static void fit_index_refill(arena_t *a, size_t range);
+static block_t *fit_index_search(arena_t *a, size_t range, size_t asize, size_t slack);
+static bool policy_indexed(void);
+static block_t *list_scan(arena_t *a, block_t *from, block_t *stop, size_t asize,
+                          bool first, unsigned bound, unsigned *checked);
 
-static void add(block_t *block_address);
-static void list_remove(block_t *block_address);
+static void tree_insert(arena_t *a, block_t *block);
+static void tree_remove(arena_t *a, block_t *block);
+static block_t *tree_best_fit(arena_t *a, size_t asize);
+static void tree_replace(arena_t *a, block_t *old, block_t *block);
+static void tree_rotate(arena_t *a, block_t *block, bool left);
 
 bool mm_checkheap(int lineno);
+bool mm_checkheap_step(size_t budget);
+bool check_free_size(void *bp, size_t size, size_t align);
+bool mm_set_policy(const mm_policy_t *policy);
+void mm_get_policy(mm_policy_t *policy);
+void mm_set_mmap_threshold(size_t size);
+void mm_set_trim_threshold(size_t size);
+void mm_set_deferred_free(bool on);
+void mm_set_deep_check(bool on);
+int mm_trim(size_t pad);
+size_t mm_maintain(size_t budget);
+bool mm_maintain_thread(size_t interval);
+void *mm_memalign(size_t alignment, size_t size);
+void *mm_aligned_alloc(size_t alignment, size_t size);
+int mm_posix_memalign(void **memptr, size_t alignment, size_t size);
+size_t mm_usable_size(void *bp);
+void mm_free_sized(void *bp, size_t size);
+void mm_free_aligned_sized(void *bp, size_t alignment, size_t size);
+size_t mm_malloc_batch(size_t size, size_t n, void **ptrs);
+void mm_free_batch(void **ptrs, size_t n);
+void mm_stats(FILE *stream, bool json);
+size_t mm_footprint(void);
+size_t mm_hugepages(void);
+handle_t *mm_halloc(size_t size);
+void *mm_hlock(handle_t *h);
+void mm_hunlock(handle_t *h);
+void mm_hfree(handle_t *h);
+size_t mm_compact(void);
+region_t *mm_region_create(size_t size);
+void *mm_region_alloc(region_t *r, size_t size);
+void mm_region_reset(region_t *r);
+void mm_region_destroy(region_t *r);
+void mm_profile_rate(size_t rate);
+void mm_profile_dump(FILE *stream, bool live);
+void mm_profile_dump_pprof(FILE *stream);
 
 /*
  * mm_init: initializes the heap; it is run once when heap_start == NULL.
@@ -123,9 +764,16 @@ bool mm_checkheap(int lineno);
  *              start            start+8           start+16
  *          INIT: | PROLOGUE_FOOTER | EPILOGUE_HEADER |
  * heap_listp ends up pointing to the epilogue header.
+ * With MM_THREADS, the extra arenas of a previous heap are released, so no
+ * other thread may be using the allocator while it runs.
  */
 bool mm_init(void)
 {
+#ifndef MM_POLICY
+    // The new heap is the first the policy set since the last one applies to
+    policy = policy_next;
+#endif
+
     // Create the initial empty heap
     word_t *start = (word_t *)(mem_sbrk(2 * wsize));
 
@@ -134,13 +782,90 @@ bool mm_init(void)
         return false;
     }
 
-    start[0] = pack(0, true, true); // Prologue footer
-    start[1] = pack(0, true, true); // Epilogue header
+    // Nothing past the end of earlier heaps has been written yet
+    char *written = main_arena.heap_brk;
+    if (main_arena.heap_clean > written)
+        written = main_arena.heap_clean;
+
+    // The segments of a previous heap go back to the OS
+    while (main_arena.segments != NULL)
+    {
+        segment_release(&main_arena, main_arena.segments);
+    }
+
+    arena_setup(&main_arena, start, NULL);
     // Heap starts with first block header (epilogue)
-    heap_listp = (block_t *)&(start[1]);
+    heap_listp = main_arena.heap_start;
+    if (!sbrk_zeroes)
+        main_arena.heap_clean = (char *)UINTPTR_MAX;
+    else if (written > main_arena.heap_clean)
+        main_arena.heap_clean = written;
+
+#ifdef MM_THREADS
+    // Drop the arenas and cached blocks that belonged to a previous heap
+    for (size_t i = 1; i < MAX_ARENAS; i++)
+    {
+        if (arenas[i] != NULL)
+        {
+            while (arenas[i]->segments != NULL)
+            {
+                segment_release(arenas[i], arenas[i]->segments);
+            }
+            munmap(segment_of(arenas[i]), segment_size);
+            arenas[i] = NULL;
+        }
+    }
+    arenas[0] = &main_arena;
+
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    arena_count = (ncpu < 1) ? 1 : (ncpu > MAX_ARENAS) ? MAX_ARENAS : (size_t)ncpu;
+#endif
+    memset(&tcache, 0, sizeof(tcache));
+
+    // Reserve the slab region and its table once; later heaps reuse them
+    // from the start
+    size_t slab_meta_size = slab_region_size / slab_run_size * sizeof(slab_t);
+    if (slab_lo == NULL)
+    {
+        slab_lo = mmap(NULL, slab_region_size + slab_meta_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (slab_lo == MAP_FAILED)
+        {
+            slab_lo = NULL; // small requests simply come from the heap
+        }
+        else
+        {
+            slab_meta = (slab_t *)(slab_lo + slab_region_size);
+        }
+    }
+    else
+    {
+        char *slab_end = slab_lo + slab_region_size;
+        slab_end = (slab_brk < slab_end) ? slab_brk : slab_end;
+        release_pages(slab_lo, slab_end);
+        release_pages((char *)slab_meta, (char *)round_up((size_t)slab_of(slab_end), mem_pagesize()));
+    }
+    slab_brk = slab_lo;
+
+    // Likewise the handle region; handles of a previous heap are forgotten
+    if (handle_lo == NULL)
+    {
+        handle_lo = mmap(NULL, handle_region_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (handle_lo == MAP_FAILED)
+        {
+            handle_lo = NULL; // mm_halloc fails
+        }
+    }
+    else
+    {
+        release_pages(handle_lo, handle_brk);
+    }
+    handle_brk = handle_lo;
+    handle_free = NULL;
 
     // Extend the empty heap with a free block of chunksize bytes
-    if (extend_heap(chunksize) == NULL)
+    if (extend_heap(&main_arena, chunksize) == NULL)
     {
         return false;
     }
@@ -160,42 +885,113 @@ bool mm_init(void)
  */
 void *malloc(size_t size)
 {
-    size_t asize;      // Adjusted block size
-    size_t extendsize; // Amount to extend heap if no fit is found
-    block_t *block;
+    void *bp = alloc_block(size, NULL);
+
+    stat_add(&stats.malloc_calls, 1);
+    stat_hist(stats.request_size, size);
+    stat_block(bp, true);
+    profile_alloc(bp, size);
+    return bp;
+}
+
+/*
+ * alloc_block: does the work of malloc. If dirty is not NULL, it is set to
+ *              the number of leading payload bytes that may be nonzero;
+ *              the rest of the payload is known to be zero.
+ */
+static void *alloc_block(size_t size, size_t *dirty)
+{
+    size_t asize; // Adjusted block size
+    arena_t *a;
     void *bp = NULL;
 
-    if (heap_listp == NULL) // Initialize heap if it isn't initialized
+    if (heap_listp == NULL && !lazy_init()) // Initialize heap if it isn't initialized
     {
-        mm_init();
+        return NULL;
     }
 
     if (size == 0) // Ignore spurious request
     {
+#ifdef DRIVER
         dbg_printf("Malloc(%zd) --> %p\n", size, bp);
         return bp;
+#else
+        // Programs take NULL from the C library's malloc as running out of
+        // memory, so they get the smallest block instead
+        size = 1;
+#endif
     }
 
-    // Adjust block size to include overhead and to meet alignment requirements
-    asize = max(round_up(size + wsize, dsize), 32);
-
-    // Search the free list for a fit
-    block = find_fit(asize);
-
-    // If no fit is found, request more memory, and then and place the block
-    if (block == NULL)
+    // Small requests come from a slab, if one can be had
+    if (size <= slab_max && slab_lo != NULL)
     {
-        extendsize = max(asize, chunksize);
-        block = extend_heap(extendsize);
-        if (block == NULL) // extend_heap returns an error
+#ifdef MM_THREADS
+        size_t slot = (size - 1) / dsize;
+        if (tcache.slots[slot] != NULL)
+        {
+            bp = tcache.slots[slot];
+            tcache.slots[slot] = *(void **)bp;
+            tcache.slot_counts[slot]--;
+            stat_add(&stats.tcache_hits, 1);
+            if (dirty != NULL)
+                *dirty = size;
+            return bp;
+        }
+#endif
+        a = thread_arena();
+        arena_lock(a);
+        bp = slab_malloc(a, size);
+        arena_unlock(a);
+        if (bp != NULL)
         {
-            dbg_printf("Malloc(%zd) --> %p\n", size, bp);
+            dbg_printf("Malloc(%zd) --> %p (slab)\n", size, bp);
+            if (dirty != NULL)
+                *dirty = size;
             return bp;
         }
     }
 
-    place(block, asize);
-    bp = header_to_payload(block);
+    // Large requests get a mapping of their own
+    if (size >= mmap_threshold)
+    {
+        bp = map_block(size, dsize);
+        dbg_printf("Malloc(%zd) --> %p (mapped)\n", size, bp);
+        if (dirty != NULL)
+            *dirty = 0; // fresh mappings are zero-filled
+        return bp;
+    }
+
+    // Adjust block size to include overhead and to meet alignment requirements
+    asize = max(round_up(size + wsize, dsize), min_block_size);
+
+    // A recently freed block of exactly this size needs no lock at all
+    size_t cls = size_class(asize);
+    if (cls < seg_exact_count && tcache.bins[cls] != NULL)
+    {
+        block_t *block = tcache.bins[cls];
+        tcache.bins[cls] = *(block_t **)header_to_payload(block);
+        tcache.counts[cls]--;
+        stat_add(&stats.tcache_hits, 1);
+        if (dirty != NULL)
+            *dirty = size;
+        return header_to_payload(block);
+    }
+
+    a = thread_arena();
+    arena_lock(a);
+    bp = arena_malloc(a, asize, dirty);
+    arena_unlock(a);
+
+#ifdef MM_THREADS
+    // An extra arena that can get no segment either borrows from the main one
+    if (bp == NULL && a != &main_arena)
+    {
+        arena_lock(&main_arena);
+        bp = arena_malloc(&main_arena, asize, dirty);
+        arena_unlock(&main_arena);
+    }
+#endif
+
     dbg_printf("Malloc(%zd) --> %p\n", size, bp);
     dbg_assert(mm_checkheap(__LINE__));
     return bp;
@@ -211,31 +1007,151 @@ void free(void *bp)
     {
         return;
     }
+    stat_add(&stats.free_calls, 1);
+    stat_block(bp, false);
+    profile_free(bp);
+
+    // Slab slots go back to their run
+    if (is_slab(bp))
+    {
+        slab_t *run = slab_of(bp);
+#ifdef MM_THREADS
+        size_t slot = run->slot_size / dsize - 1;
+        if (run->arena == tcache.arena && tcache.slot_counts[slot] < tcache_fill)
+        {
+            *(void **)bp = tcache.slots[slot];
+            tcache.slots[slot] = bp;
+            tcache.slot_counts[slot]++;
+            return;
+        }
+#endif
+        arena_lock(run->arena);
+        slab_free(run, bp);
+        arena_unlock(run->arena);
+        dbg_printf("Completed free(%p) (slab)\n", bp);
+        return;
+    }
 
     block_t *block = payload_to_header(bp);
-    size_t size = get_size(block);
 
-    write_header(block, size, false, get_alloc_of_prev(block));
-    write_footer(block, size, false);
+    // Mapped blocks go straight back to the OS
+    if (get_mapped(block))
+    {
+        unmap_block(block);
+        dbg_printf("Completed free(%p) (unmapped)\n", bp);
+        return;
+    }
+
+    arena_t *a = arena_of(block);
+
+#ifdef MM_THREADS
+    // Keep small blocks of our own arena in the thread cache, without locking
+    size_t cls = size_class(get_size(block));
+    if (a == tcache.arena && cls < seg_exact_count && tcache.counts[cls] < tcache_fill)
+    {
+        *(block_t **)header_to_payload(block) = tcache.bins[cls];
+        tcache.bins[cls] = block;
+        tcache.counts[cls]++;
+        return;
+    }
+#endif
+
+    // Leave the coalescing to mm_maintain if asked to
+    if (__atomic_load_n(&defer_frees, __ATOMIC_RELAXED))
+    {
+        pending_push(a, block);
+        dbg_printf("Completed free(%p) (deferred)\n", bp);
+        return;
+    }
 
-    coalesce(block);
+    // Blocks always go back to the arena that owns them
+    arena_lock(a);
+    arena_free(a, block);
+    arena_unlock(a);
 
     dbg_printf("Completed free(%p)\n", bp);
 }
 
+/*
+ * mm_free_sized: frees the block at bp, which the caller says was allocated
+ *                (or last reallocated) with size bytes. A heap block of an
+ *                exact size class owned by this thread's arena (the main
+ *                arena without MM_THREADS) goes straight into the thread
+ *                cache, its class taken from size and its owner from its
+ *                address, without decoding its header or coalescing it.
+ *                That is only done while the policy's split_min is dsize,
+ *                since a larger one lets a block keep a tail that puts it
+ *                in a larger class than size. Everything else is freed as
+ *                free would. DEBUG builds check size against the block.
+ */
+void mm_free_sized(void *bp, size_t size)
+{
+    if (bp == NULL)
+    {
+        return;
+    }
+    dbg_assert(check_free_size(bp, size, dsize));
+
+    // Slab slots and mapped blocks are not in any arena's heap. A block is
+    // no larger than size asks for only if placing it split off any tail
+    // of dsize bytes or more
+#ifdef MM_THREADS
+    arena_t *a = tcache.arena;
+#else
+    arena_t *a = &main_arena;
+#endif
+    if (size > slab_max && size < SIZE_MAX - dsize && a != NULL &&
+        max(policy.split_min, min_block_size) <= dsize)
+    {
+        size_t cls = size_class(max(round_up(size + wsize, dsize), min_block_size));
+        char *p = (char *)bp;
+        if (cls < seg_exact_count && tcache.counts[cls] < tcache_fill &&
+            p > a->heap_lo && p < a->heap_brk)
+        {
+            stat_add(&stats.free_calls, 1);
+            stat_block(bp, false);
+            profile_free(bp);
+            block_t *block = payload_to_header(bp);
+            *(block_t **)bp = tcache.bins[cls];
+            tcache.bins[cls] = block;
+            tcache.counts[cls]++;
+            return;
+        }
+    }
+
+    free(bp);
+}
+
+/*
+ * mm_free_aligned_sized: frees the block at bp, which the caller says was
+ *                        allocated with mm_memalign(alignment, size).
+ */
+void mm_free_aligned_sized(void *bp, size_t alignment, size_t size)
+{
+    dbg_assert(bp == NULL || check_free_size(bp, size, alignment));
+    mm_free_sized(bp, size);
+}
+
 /*
  * realloc: returns a pointer to an allocated region of at least size bytes:
  *          if ptrv is NULL, then call malloc(size);
  *          if size == 0, then call free(ptr) and returns NULL;
- *          else allocates new region of memory, copies old data to new memory,
- *          and then free old block. Returns old block if realloc fails or
- *          returns new pointer on success.
+ *          if the block is already large enough, shrinks it in place and
+ *          frees the tail; if the next block is free, or the block sits at
+ *          the end of the heap, grows it in place; else allocates new region
+ *          of memory, copies old data to new memory, and then free old block.
+ *          Returns NULL and leaves the old block untouched if realloc fails,
+ *          or returns the (possibly unchanged) pointer on success.
  */
 void *realloc(void *ptr, size_t size)
 {
     block_t *block = payload_to_header(ptr);
+    size_t asize;
     size_t copysize;
     void *newptr;
+    bool in_place;
+
+    stat_add(&stats.realloc_calls, 1);
 
     // If size == 0, then free block and return NULL
     if (size == 0)
@@ -250,7 +1166,68 @@ void *realloc(void *ptr, size_t size)
         return malloc(size);
     }
 
+    // A slab slot is reused while the new size still fits in it
+    if (is_slab(ptr))
+    {
+        copysize = slab_of(ptr)->slot_size;
+        if (size <= copysize)
+        {
+            return ptr;
+        }
+        newptr = malloc(size);
+        if (newptr != NULL)
+        {
+            memcpy(newptr, ptr, copysize);
+            free(ptr);
+        }
+        return newptr;
+    }
+
+    // A mapped block that stays large is resized by the kernel, without copying
+    if (get_mapped(block) && size >= mmap_threshold)
+    {
+        stat_add(&stats.realloc_remap, 1);
+        newptr = remap_block(block, size);
+        if (newptr != NULL)
+        {
+            profile_move(ptr, newptr);
+        }
+        return newptr;
+    }
+
+    // Adjust block size the same way malloc does
+    asize = max(round_up(size + wsize, dsize), min_block_size);
+
+    // Shrinking, or growing into a free neighbor or the heap tail
+    in_place = false;
+    if (!get_mapped(block))
+    {
+        size_t old_size = get_size(block);
+        arena_t *a = arena_of(block);
+        arena_lock(a);
+        in_place = asize <= get_size(block) || grow_in_place(a, block, asize);
+        if (in_place)
+        {
+            split_tail(a, block, asize);
+        }
+        arena_unlock(a);
+
+        if (in_place && get_size(block) > old_size)
+            stat_add(&stats.alloc_bytes, get_size(block) - old_size);
+        else if (in_place)
+            stat_add(&stats.freed_bytes, old_size - get_size(block));
+    }
+
+    if (in_place)
+    {
+        stat_add(&stats.realloc_in_place, 1);
+        dbg_printf("Realloc(%p, %zd) --> %p (in place)\n", ptr, size, ptr);
+        dbg_assert(mm_checkheap(__LINE__));
+        return ptr;
+    }
+
     // Otherwise, proceed with reallocation
+    stat_add(&stats.realloc_copy, 1);
     newptr = malloc(size);
     // If malloc fails, the original block is left untouched
     if (!newptr)
@@ -281,245 +1258,3945 @@ void *calloc(size_t nmemb, size_t size)
 {
     void *bp;
     size_t asize = nmemb * size;
+    size_t dirty;
 
-    if (asize / nmemb != size)
+    if (nmemb != 0 && asize / nmemb != size)
         // Multiplication overflowed
         return NULL;
 
-    bp = malloc(asize);
+    bp = alloc_block(asize, &dirty);
+    stat_add(&stats.calloc_calls, 1);
+    stat_hist(stats.request_size, asize);
+    profile_alloc(bp, asize);
     if (bp == NULL)
     {
         return NULL;
     }
-    // Initialize all bits to 0
-    memset(bp, 0, asize);
+    stat_block(bp, true);
+    // Initialize to 0 whatever is not known to be 0 already; memset moves
+    // to vector and non-temporal stores for large sizes by itself
+    memset(bp, 0, (dirty < asize) ? dirty : asize);
 
     return bp;
 }
 
-/******** The remaining content below are helper and debug routines ********/
+/*
+ * mm_memalign: allocates a block of at least size bytes whose payload is a
+ *              multiple of alignment, which must be a power of two. The
+ *              heap is searched for a block with room for the alignment gap,
+ *              which is split off as a free block of its own; large requests
+ *              get an aligned mapping. The result is released with free.
+ *              Returns NULL on failure or a bad alignment.
+ */
+void *mm_memalign(size_t alignment, size_t size)
+{
+    size_t asize;
+    arena_t *a;
+    void *bp = NULL;
+
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    // Every payload is already dsize aligned
+    if (alignment <= dsize)
+    {
+        return malloc(size);
+    }
+
+    if (heap_listp == NULL && !lazy_init())
+    {
+        return NULL;
+    }
+
+    if (size == 0)
+    {
+        return NULL;
+    }
+
+    if (size >= mmap_threshold)
+    {
+        bp = map_block(size, alignment);
+        profile_alloc(bp, size);
+        dbg_printf("Memalign(%zd, %zd) --> %p (mapped)\n", alignment, size, bp);
+        return bp;
+    }
+
+    asize = max(round_up(size + wsize, dsize), min_block_size);
+
+    a = thread_arena();
+    arena_lock(a);
+    bp = arena_memalign(a, alignment, asize);
+    arena_unlock(a);
+
+#ifdef MM_THREADS
+    if (bp == NULL && a != &main_arena)
+    {
+        arena_lock(&main_arena);
+        bp = arena_memalign(&main_arena, alignment, asize);
+        arena_unlock(&main_arena);
+    }
+#endif
+
+    stat_add(&stats.memalign_calls, 1);
+    stat_hist(stats.request_size, size);
+    stat_block(bp, true);
+    profile_alloc(bp, size);
+    dbg_printf("Memalign(%zd, %zd) --> %p\n", alignment, size, bp);
+    dbg_assert(mm_checkheap(__LINE__));
+    return bp;
+}
+
+/*
+ * mm_aligned_alloc: C11 aligned_alloc; the same as mm_memalign.
+ */
+void *mm_aligned_alloc(size_t alignment, size_t size)
+{
+    return mm_memalign(alignment, size);
+}
+
+/*
+ * mm_posix_memalign: POSIX posix_memalign. Stores the block in *memptr and
+ *                    returns 0, or returns EINVAL if alignment is not a
+ *                    power-of-two multiple of sizeof(void *), or ENOMEM.
+ */
+int mm_posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0)
+    {
+        return EINVAL;
+    }
+
+    void *bp = mm_memalign(alignment, size);
+    if (bp == NULL && size != 0)
+    {
+        return ENOMEM;
+    }
+    *memptr = bp;
+    return 0;
+}
+
+/*
+ * mm_usable_size: returns how many bytes the block at bp can hold, which
+ *                 is at least what it was allocated with; 0 for NULL.
+ */
+size_t mm_usable_size(void *bp)
+{
+    if (bp == NULL)
+    {
+        return 0;
+    }
+    if (is_slab(bp))
+    {
+        return slab_of(bp)->slot_size;
+    }
+    return get_payload_size(payload_to_header(bp));
+}
+
+#ifndef DRIVER
+/*
+ * The rest of the malloc family, so that the allocator can stand in for the
+ * C library's when built as a shared library and preloaded.
+ */
+
+void *memalign(size_t alignment, size_t size)
+{
+    return mm_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    return mm_aligned_alloc(alignment, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    return mm_posix_memalign(memptr, alignment, size);
+}
+
+size_t malloc_usable_size(void *bp)
+{
+    return mm_usable_size(bp);
+}
+
+void free_sized(void *bp, size_t size)
+{
+    mm_free_sized(bp, size);
+}
+
+void free_aligned_sized(void *bp, size_t alignment, size_t size)
+{
+    mm_free_aligned_sized(bp, alignment, size);
+}
+
+/*
+ * reallocarray: realloc to nmemb * size bytes, failing with ENOMEM instead
+ *               if the product overflows.
+ */
+void *reallocarray(void *ptr, size_t nmemb, size_t size)
+{
+    if (size != 0 && nmemb > SIZE_MAX / size)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, nmemb * size);
+}
+
+/*
+ * valloc: allocates size bytes aligned to a page.
+ */
+void *valloc(size_t size)
+{
+    return mm_memalign(mem_pagesize(), size);
+}
+
+/*
+ * pvalloc: allocates size bytes, rounded up to a whole page, aligned to a
+ *          page.
+ */
+void *pvalloc(size_t size)
+{
+    size_t page = mem_pagesize();
+
+    if (size > SIZE_MAX - page)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return mm_memalign(page, round_up(max(size, 1), page));
+}
+#endif /* ndef DRIVER */
+
+/*
+ * mm_malloc_batch: allocates n blocks of size bytes each and stores them in
+ *                  ptrs. Heap blocks are carved side by side out of a single
+ *                  free block, taken off its list once; small requests come
+ *                  from slabs under a single lock. Returns how many blocks
+ *                  were allocated, which is less than n only when memory
+ *                  runs out.
+ */
+size_t mm_malloc_batch(size_t size, size_t n, void **ptrs)
+{
+    size_t done = 0;
+    arena_t *a;
+
+    if (heap_listp == NULL && !lazy_init())
+    {
+        return 0;
+    }
+
+    if (size == 0 || n == 0)
+    {
+        return 0;
+    }
+
+    if (size <= slab_max && slab_lo != NULL)
+    {
+        a = thread_arena();
+        arena_lock(a);
+        while (done < n && (ptrs[done] = slab_malloc(a, size)) != NULL)
+        {
+            done++;
+        }
+        arena_unlock(a);
+    }
+    else if (size < mmap_threshold)
+    {
+        size_t asize = max(round_up(size + wsize, dsize), min_block_size);
+
+        a = thread_arena();
+        arena_lock(a);
+        bool carved = arena_malloc_batch(a, asize, n, ptrs);
+        arena_unlock(a);
+        if (carved)
+        {
+            done = n;
+        }
+    }
+
+    // Count what came out of the batch paths; malloc counts the rest
+    stat_add(&stats.malloc_calls, done);
+    for (size_t i = 0; i < done; i++)
+    {
+        stat_hist(stats.request_size, size);
+        stat_block(ptrs[i], true);
+    }
+
+    // Whatever could not be had in one go is allocated one at a time
+    while (done < n && (ptrs[done] = malloc(size)) != NULL)
+    {
+        done++;
+    }
+
+    dbg_printf("Malloc_batch(%zd, %zd) --> %zd blocks\n", size, n, done);
+    dbg_assert(mm_checkheap(__LINE__));
+    return done;
+}
+
+/*
+ * ptr_order: qsort comparator that orders pointers by address.
+ */
+static int ptr_order(const void *x, const void *y)
+{
+    uintptr_t p = (uintptr_t)*(void *const *)x;
+    uintptr_t q = (uintptr_t)*(void *const *)y;
+    return (p > q) - (p < q);
+}
+
+/*
+ * mm_free_batch: frees the n blocks in ptrs, which may include NULLs, and
+ *                reorders the array by address. Runs of heap blocks that
+ *                lie side by side are merged into one block and freed with
+ *                a single coalesce, and each arena is locked once per run
+ *                of its blocks.
+ */
+void mm_free_batch(void **ptrs, size_t n)
+{
+    arena_t *locked = NULL;
+
+    qsort(ptrs, n, sizeof(void *), ptr_order);
+
+    for (size_t i = 0; i < n; i++)
+    {
+        if (ptrs[i] == NULL)
+        {
+            continue;
+        }
+
+        block_t *block = payload_to_header(ptrs[i]);
+        if (is_slab(ptrs[i]) || get_mapped(block))
+        {
+            if (locked != NULL)
+            {
+                arena_unlock(locked);
+                locked = NULL;
+            }
+            free(ptrs[i]);
+            continue;
+        }
+
+        arena_t *a = arena_of(block);
+        if (a != locked)
+        {
+            if (locked != NULL)
+                arena_unlock(locked);
+            arena_lock(a);
+            locked = a;
+        }
+
+        // Absorb the blocks that directly follow this one
+        size_t size = get_size(block);
+        stat_add(&stats.free_calls, 1);
+        stat_block(ptrs[i], false);
+        profile_free(ptrs[i]);
+        while (i + 1 < n && ptrs[i + 1] == header_to_payload(find_next(block)))
+        {
+            stat_add(&stats.free_calls, 1);
+            stat_block(ptrs[i + 1], false);
+            profile_free(ptrs[i + 1]);
+            block_t *next = payload_to_header(ptrs[++i]);
+            size += get_size(next);
+            merged(a, next, block);
+            write_header(block, size, true, get_alloc_of_prev(block), get_prev_mini(block));
+        }
+        arena_free(a, block);
+    }
+
+    if (locked != NULL)
+    {
+        arena_unlock(locked);
+    }
+    dbg_printf("Completed free_batch(%zd blocks)\n", n);
+    dbg_assert(mm_checkheap(__LINE__));
+}
+
+/*
+ * stat_walk: adds the arena's heap bytes, free bytes and free blocks to
+ *            totals[0..2], raises totals[3] to its largest free block, and
+ *            adds its segments to totals[4] and its pending frees to
+ *            totals[5]. The caller holds the arena's lock.
+ */
+static void stat_walk(arena_t *a, uint64_t totals[6])
+{
+    totals[0] += heap_bytes(a);
+    for (block_t *block = a->heap_start; block != NULL; block = next_part(a, block))
+    {
+        for (; get_size(block) > 0; block = find_next(block))
+        {
+            if (!get_alloc(block))
+            {
+                totals[1] += get_size(block);
+                totals[2]++;
+                totals[3] = max(totals[3], get_size(block));
+            }
+        }
+    }
+    for (segment_t *seg = a->segments; seg != NULL; seg = seg->next)
+    {
+        totals[4]++;
+    }
+    block_t *lists[2] = {a->merging, __atomic_load_n(&a->pending, __ATOMIC_ACQUIRE)};
+    for (size_t i = 0; i < 2; i++)
+    {
+        for (block_t *block = lists[i]; block != NULL; block = *(block_t **)header_to_payload(block))
+        {
+            totals[5]++;
+        }
+    }
+}
+
+/*
+ * stat_line: prints one named value of mm_stats, as a text line or a JSON
+ *            member; first tells whether a separator is due.
+ */
+static void stat_line(FILE *stream, bool json, bool *first, const char *name, uint64_t value)
+{
+    if (json)
+        fprintf(stream, "%s\n  \"%s\": %llu", *first ? "{" : ",", name, (unsigned long long)value);
+    else
+        fprintf(stream, "%-20s %llu\n", name, (unsigned long long)value);
+    *first = false;
+}
+
+#ifdef MM_STATS
+/*
+ * stat_list: prints an array of counters the same way, as a JSON array or
+ *            as one text line; trailing zeros are left out.
+ */
+static void stat_list(FILE *stream, bool json, bool *first, const char *name,
+                      const uint64_t *values, size_t count)
+{
+    while (count > 0 && values[count - 1] == 0)
+        count--;
+
+    if (json)
+        fprintf(stream, "%s\n  \"%s\": [", *first ? "{" : ",", name);
+    else
+        fprintf(stream, "%-20s", name);
+    for (size_t i = 0; i < count; i++)
+        fprintf(stream, json ? "%s%llu" : "%s %llu", (json && i > 0) ? ", " : "",
+                (unsigned long long)values[i]);
+    fprintf(stream, json ? "]" : "\n");
+    *first = false;
+}
+#endif
+
+/*
+ * mm_stats: prints what the allocator is doing to stream, as text or as a
+ *           JSON object. A walk of every arena gives the heap size, the free
+ *           bytes and blocks, the largest free block, and the external
+ *           fragmentation, in thousandths: 1000 * (1 - largest / free).
+ *           With MM_STATS, the counters follow.
+ */
+void mm_stats(FILE *stream, bool json)
+{
+    // Heap bytes, free bytes, free blocks, the largest free block,
+    // segments, and pending frees
+    uint64_t walk[6] = {0, 0, 0, 0, 0, 0};
+    bool first = true;
+
+    if (heap_listp != NULL)
+    {
+#ifdef MM_THREADS
+        for (size_t i = 0; i < MAX_ARENAS; i++)
+        {
+            arena_t *a = arena_at(i);
+            if (a == NULL)
+                continue;
+            arena_lock(a);
+            stat_walk(a, walk);
+            arena_unlock(a);
+        }
+#else
+        stat_walk(&main_arena, walk);
+#endif
+    }
+
+    stat_line(stream, json, &first, "heap_bytes", walk[0]);
+    stat_line(stream, json, &first, "heap_segments", walk[4]);
+    stat_line(stream, json, &first, "huge_pages", mm_hugepages());
+    stat_line(stream, json, &first, "slab_bytes", (uint64_t)(slab_brk - slab_lo));
+    stat_line(stream, json, &first, "mapped_bytes", __atomic_load_n(&mapped_bytes, __ATOMIC_RELAXED));
+    stat_line(stream, json, &first, "free_bytes", walk[1]);
+    stat_line(stream, json, &first, "free_blocks", walk[2]);
+    stat_line(stream, json, &first, "largest_free", walk[3]);
+    stat_line(stream, json, &first, "pending_frees", walk[5]);
+    stat_line(stream, json, &first, "fragmentation",
+              walk[1] ? 1000 - walk[3] * 1000 / walk[1] : 0);
+
+#ifdef MM_STATS
+    stat_line(stream, json, &first, "in_use_bytes", stats.alloc_bytes - stats.freed_bytes);
+    stat_line(stream, json, &first, "malloc_calls", stats.malloc_calls);
+    stat_line(stream, json, &first, "calloc_calls", stats.calloc_calls);
+    stat_line(stream, json, &first, "realloc_calls", stats.realloc_calls);
+    stat_line(stream, json, &first, "free_calls", stats.free_calls);
+    stat_line(stream, json, &first, "memalign_calls", stats.memalign_calls);
+    stat_line(stream, json, &first, "alloc_bytes", stats.alloc_bytes);
+    stat_line(stream, json, &first, "freed_bytes", stats.freed_bytes);
+    stat_line(stream, json, &first, "maps", stats.maps);
+    stat_line(stream, json, &first, "unmaps", stats.unmaps);
+    stat_line(stream, json, &first, "remaps", stats.remaps);
+    stat_line(stream, json, &first, "heap_grows", stats.heap_grows);
+    stat_line(stream, json, &first, "heap_grow_bytes", stats.heap_grow_bytes);
+    stat_line(stream, json, &first, "released_bytes", stats.released_bytes);
+    stat_line(stream, json, &first, "realloc_in_place", stats.realloc_in_place);
+    stat_line(stream, json, &first, "realloc_remap", stats.realloc_remap);
+    stat_line(stream, json, &first, "realloc_copy", stats.realloc_copy);
+    stat_line(stream, json, &first, "tcache_hits", stats.tcache_hits);
+    stat_list(stream, json, &first, "coalesce_cases", stats.coalesce_cases, 4);
+    stat_list(stream, json, &first, "fit_scan", stats.fit_scan, STAT_BUCKETS);
+    stat_list(stream, json, &first, "request_size", stats.request_size, STAT_BUCKETS);
+#endif
+
+    if (json)
+        fprintf(stream, "\n}\n");
+}
+
+/*
+ * mm_footprint: returns the bytes of address space the allocator holds:
+ *               every arena's heap, the slab runs and handles handed out so
+ *               far, and the direct mappings.
+ */
+size_t mm_footprint(void)
+{
+    size_t bytes = (slab_brk - slab_lo) + __atomic_load_n(&mapped_bytes, __ATOMIC_RELAXED) +
+                   (handle_brk - handle_lo);
+
+    if (heap_listp == NULL)
+    {
+        return bytes;
+    }
+
+#ifdef MM_THREADS
+    for (size_t i = 0; i < MAX_ARENAS; i++)
+    {
+        arena_t *a = arena_at(i);
+        if (a == NULL)
+            continue;
+        arena_lock(a);
+        bytes += heap_bytes(a);
+        arena_unlock(a);
+    }
+#else
+    bytes += heap_bytes(&main_arena);
+#endif
+    return bytes;
+}
+
+/*
+ * mm_hugepages: returns how many transparent huge pages back the heaps, as
+ *               /proc/self/smaps reports them, or 0 if it cannot be read.
+ */
+size_t mm_hugepages(void)
+{
+    if (heap_listp == NULL)
+    {
+        return 0;
+    }
+    return smaps_huge_bytes() / huge_page;
+}
+
+/*
+ * heap_overlaps: whether [lo, hi) overlaps the heap or a segment of any
+ *                arena.
+ */
+static bool heap_overlaps(uintptr_t lo, uintptr_t hi)
+{
+#ifdef MM_THREADS
+    for (size_t i = 0; i < MAX_ARENAS; i++)
+    {
+        arena_t *a = arena_at(i);
+        if (a != NULL && arena_overlaps(a, lo, hi))
+            return true;
+    }
+    return false;
+#else
+    return arena_overlaps(&main_arena, lo, hi);
+#endif
+}
+
+/*
+ * arena_overlaps: whether [lo, hi) overlaps arena a's heap or one of its
+ *                 segments. Takes the arena's lock.
+ */
+static bool arena_overlaps(arena_t *a, uintptr_t lo, uintptr_t hi)
+{
+    arena_lock(a);
+    bool overlaps = lo < (uintptr_t)a->heap_brk && (uintptr_t)a->heap_lo < hi;
+    for (segment_t *seg = a->segments; seg != NULL && !overlaps; seg = seg->next)
+    {
+        overlaps = lo < (uintptr_t)seg + segment_size && (uintptr_t)seg < hi;
+    }
+    arena_unlock(a);
+    return overlaps;
+}
+
+/*
+ * smaps_huge_bytes: adds up the AnonHugePages of every mapping in
+ *                   /proc/self/smaps that overlaps a heap or segment.
+ *                   Reads the file with plain read(2) and a buffer on the
+ *                   stack, since the caller may be malloc's replacement.
+ */
+static size_t smaps_huge_bytes(void)
+{
+    static const char field[] = "AnonHugePages:";
+    int fd = open("/proc/self/smaps", O_RDONLY | O_CLOEXEC);
+    char buf[4096];
+    char line[128];
+    size_t len = 0; // bytes of the current line in line, up to its size
+    bool overlaps = false; // the current mapping overlaps a heap
+    size_t bytes = 0;
+    ssize_t got;
+
+    if (fd < 0)
+    {
+        return 0;
+    }
+    while ((got = read(fd, buf, sizeof(buf))) > 0 || (got < 0 && errno == EINTR))
+    {
+        for (ssize_t i = 0; i < got; i++)
+        {
+            if (buf[i] != '\n')
+            {
+                if (len < sizeof(line) - 1)
+                    line[len++] = buf[i];
+                continue;
+            }
+            line[len] = '\0';
+            len = 0;
+
+            // A mapping starts with a line "start-end perms ...", in hex
+            char *end;
+            uintptr_t start = (uintptr_t)strtoull(line, &end, 16);
+            if (end != line && *end == '-')
+            {
+                uintptr_t stop = (uintptr_t)strtoull(end + 1, NULL, 16);
+                overlaps = heap_overlaps(start, stop);
+            }
+            else if (overlaps && strncmp(line, field, sizeof(field) - 1) == 0)
+            {
+                bytes += (size_t)strtoull(line + sizeof(field) - 1, NULL, 10) * 1024;
+            }
+        }
+    }
+    close(fd);
+    return bytes;
+}
+
+/*
+ * mm_trim: gives as much free memory back to the OS as possible, keeping
+ *          pad bytes at the end of each heap: pending frees are merged, the
+ *          last block of an extra arena is shrunk, and the pages inside
+ *          every other free block (and the end of the main heap, which
+ *          mem_sbrk cannot lower) are released. Returns 1 if any memory was
+ *          released, 0 otherwise.
+ */
+int mm_trim(size_t pad)
+{
+    size_t released = 0;
+
+    if (heap_listp == NULL)
+    {
+        return 0;
+    }
+
+#ifdef MM_THREADS
+    for (size_t i = 0; i < MAX_ARENAS; i++)
+    {
+        arena_t *a = arena_at(i);
+        if (a == NULL)
+            continue;
+        arena_lock(a);
+        pending_merge(a, SIZE_MAX);
+        released += trim_arena(a, pad);
+        arena_unlock(a);
+    }
+#else
+    pending_merge(&main_arena, SIZE_MAX);
+    released = trim_arena(&main_arena, pad);
+#endif
+
+    dbg_printf("Trim(%zd) released %zd bytes\n", pad, released);
+    return released > 0;
+}
+
+/*
+ * mm_maintain: merges pending frees into their arenas' free lists for up to
+ *              budget microseconds, or until none are left if budget is 0,
+ *              releasing idle pages as free would, then refills the packed
+ *              fit indexes. Arenas take turns at being first, so a small
+ *              budget still reaches every one of them over several calls.
+ *              Each arena's lock is held for maint_batch blocks at a time.
+ *              Returns the number of blocks merged.
+ */
+size_t mm_maintain(size_t budget)
+{
+    uint64_t deadline = (budget == 0) ? UINT64_MAX : now_us() + budget;
+    size_t merged = 0;
+
+    if (heap_listp == NULL)
+    {
+        return 0;
+    }
+
+#ifdef MM_THREADS
+    static size_t first = 0;
+    size_t start = __atomic_fetch_add(&first, 1, __ATOMIC_RELAXED);
+    for (size_t n = 0; n < MAX_ARENAS && now_us() < deadline; n++)
+    {
+        size_t i = (start + n) % MAX_ARENAS;
+        arena_t *a = arena_at(i);
+        if (a != NULL)
+            merged += arena_maintain(a, deadline);
+    }
+#else
+    merged = arena_maintain(&main_arena, deadline);
+#endif
+
+    dbg_printf("Maintain(%zd) merged %zd blocks\n", budget, merged);
+    return merged;
+}
+
+#ifdef MM_THREADS
+/*
+ * maint_main: the maintenance thread. Every maint_interval microseconds it
+ *             runs mm_maintain with a quarter of that as its budget, until
+ *             maint_stop is set.
+ */
+static void *maint_main(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&maint_lock);
+    while (!maint_stop)
+    {
+        struct timespec wake;
+        clock_gettime(CLOCK_REALTIME, &wake);
+        uint64_t ns = (uint64_t)wake.tv_nsec + (uint64_t)maint_interval * 1000;
+        wake.tv_sec += ns / 1000000000;
+        wake.tv_nsec = ns % 1000000000;
+        if (pthread_cond_timedwait(&maint_cond, &maint_lock, &wake) != ETIMEDOUT)
+            continue; // stopped, retuned or woken spuriously
+
+        size_t budget = max(maint_interval / 4, 1);
+        pthread_mutex_unlock(&maint_lock);
+        mm_maintain(budget);
+        pthread_mutex_lock(&maint_lock);
+    }
+    pthread_mutex_unlock(&maint_lock);
+    return NULL;
+}
+#endif
+
+/*
+ * mm_maintain_thread: with an interval above 0, defers frees and has a
+ *                     thread run mm_maintain every interval microseconds,
+ *                     starting the thread if it is not running yet. With 0,
+ *                     stops the thread, turns deferral off, and merges
+ *                     every pending free. Returns false if no thread could
+ *                     be started; without MM_THREADS there never is one.
+ *                     The thread must be stopped around mm_init, and a
+ *                     child of fork does not inherit it.
+ */
+bool mm_maintain_thread(size_t interval)
+{
+#ifdef MM_THREADS
+    pthread_mutex_lock(&maint_lock);
+    bool running = maint_running;
+    maint_interval = interval;
+    maint_stop = (interval == 0);
+    pthread_cond_signal(&maint_cond);
+    if (interval > 0 && !running)
+    {
+        maint_running = (pthread_create(&maint_thread, NULL, maint_main, NULL) == 0);
+    }
+    else if (interval == 0)
+    {
+        maint_running = false;
+    }
+    bool ok = (interval == 0 || maint_running);
+    pthread_mutex_unlock(&maint_lock);
+
+    // The thread is joined without the lock, which it needs to see the stop
+    if (interval == 0 && running)
+    {
+        pthread_join(maint_thread, NULL);
+    }
+    if (ok)
+    {
+        mm_set_deferred_free(interval > 0);
+    }
+    return ok;
+#else
+    if (interval == 0)
+    {
+        mm_set_deferred_free(false);
+    }
+    return interval == 0;
+#endif
+}
+
+/*
+ * mm_halloc: allocates a block of at least size bytes that mm_compact may
+ *            move, and returns a handle to it, or NULL on failure. The
+ *            block's address is only known, and stable, while the handle
+ *            is locked with mm_hlock. The block always comes from a heap,
+ *            however large it is, since that is where it can be moved.
+ */
+handle_t *mm_halloc(size_t size)
+{
+    if (heap_listp == NULL && !lazy_init())
+    {
+        return NULL;
+    }
+
+    // Room for the back pointer, padded to keep the caller's data aligned
+    if (size > SIZE_MAX - 2 * dsize)
+    {
+        return NULL;
+    }
+    size_t asize = round_up(size + dsize + wsize, dsize);
+
+    handle_t *h = handle_new();
+    if (h == NULL)
+    {
+        return NULL;
+    }
+
+    // The block is tagged before the lock is dropped, so that compaction
+    // never sees it half made
+    arena_t *a = thread_arena();
+    arena_lock(a);
+    void *bp = arena_malloc(a, asize, NULL);
+    if (bp != NULL)
+    {
+        *(handle_t **)bp = h;
+        __atomic_store_n(&h->ptr, bp, __ATOMIC_RELAXED);
+        h->locks = 0;
+    }
+    arena_unlock(a);
+
+#ifdef MM_THREADS
+    // An extra arena that can get no segment either borrows from the main one
+    if (bp == NULL && a != &main_arena)
+    {
+        arena_lock(&main_arena);
+        bp = arena_malloc(&main_arena, asize, NULL);
+        if (bp != NULL)
+        {
+            *(handle_t **)bp = h;
+            __atomic_store_n(&h->ptr, bp, __ATOMIC_RELAXED);
+            h->locks = 0;
+        }
+        arena_unlock(&main_arena);
+    }
+#endif
+
+    if (bp == NULL)
+    {
+        handle_release(h);
+        return NULL;
+    }
+    stat_add(&stats.malloc_calls, 1);
+    stat_hist(stats.request_size, size);
+    stat_block(bp, true);
+    dbg_printf("Halloc(%zd) --> %p (%p)\n", size, (void *)h, bp);
+    return h;
+}
+
+/*
+ * mm_hlock: locks the handle's block in place and returns the address of
+ *           its data, which stays valid until the matching mm_hunlock.
+ *           Locks nest.
+ */
+void *mm_hlock(handle_t *h)
+{
+    // The block only ever moves within its arena, so a stale address
+    // still finds the right lock
+    arena_t *a = arena_of(payload_to_header(__atomic_load_n(&h->ptr, __ATOMIC_RELAXED)));
+
+    arena_lock(a);
+    h->locks++;
+    void *bp = (char *)h->ptr + dsize;
+    arena_unlock(a);
+    return bp;
+}
+
+/*
+ * mm_hunlock: undoes one mm_hlock; once no lock is left, the block may
+ *             be moved again. An unlock with no lock held does nothing,
+ *             rather than wrap the count and pin the block for good.
+ */
+void mm_hunlock(handle_t *h)
+{
+    arena_t *a = arena_of(payload_to_header(__atomic_load_n(&h->ptr, __ATOMIC_RELAXED)));
+
+    arena_lock(a);
+    dbg_assert(h->locks > 0);
+    if (h->locks > 0)
+    {
+        h->locks--;
+    }
+    arena_unlock(a);
+}
+
+/*
+ * mm_hfree: frees the handle's block and the handle itself. Does nothing
+ *           if h is NULL.
+ */
+void mm_hfree(handle_t *h)
+{
+    if (h == NULL)
+    {
+        return;
+    }
+
+    arena_t *a = arena_of(payload_to_header(__atomic_load_n(&h->ptr, __ATOMIC_RELAXED)));
+
+    arena_lock(a);
+    block_t *block = payload_to_header(h->ptr); // where it is now
+    stat_add(&stats.free_calls, 1);
+    stat_block(h->ptr, false);
+    arena_free(a, block);
+    arena_unlock(a);
+
+    handle_release(h);
+    dbg_printf("Completed hfree(%p)\n", (void *)h);
+    dbg_assert(mm_checkheap(__LINE__));
+}
+
+/*
+ * mm_compact: moves every unlocked handle block that follows a free block
+ *             down to the start of that free block, so that free space
+ *             rises past runs of movable blocks, joining the free blocks
+ *             above them and finally the wilderness, whose tail is then
+ *             given back to the OS; pending frees are merged first so
+ *             that their space rises too. Blocks from malloc, and locked
+ *             handle blocks, stay put and stop the free space from rising
+ *             further. Takes one pass over each heap and each of its
+ *             segments; a segment left wholly free is unmapped, and the
+ *             free pages at the top of the others are released. Returns
+ *             the bytes released.
+ */
+size_t mm_compact(void)
+{
+    size_t released = 0;
+
+    if (heap_listp == NULL)
+    {
+        return 0;
+    }
+
+#ifdef MM_THREADS
+    for (size_t i = 0; i < MAX_ARENAS; i++)
+    {
+        arena_t *a = arena_at(i);
+        if (a == NULL)
+            continue;
+        arena_lock(a);
+        pending_merge(a, SIZE_MAX);
+        released += compact_arena(a);
+        arena_unlock(a);
+    }
+#else
+    pending_merge(&main_arena, SIZE_MAX);
+    released = compact_arena(&main_arena);
+#endif
+
+    dbg_printf("Compact released %zd bytes\n", released);
+    dbg_assert(mm_checkheap(__LINE__));
+    return released;
+}
+
+/*
+ * mm_region_create: makes an empty region whose first chunk has room for
+ *                   at least size bytes of objects (region_chunk_min if
+ *                   size is smaller). Returns NULL on failure. A region is
+ *                   not locked; only one thread at a time may use it.
+ */
+region_t *mm_region_create(size_t size)
+{
+    size_t overhead = sizeof(region_chunk_t) + sizeof(region_t);
+    if (size > SIZE_MAX - overhead - dsize)
+    {
+        return NULL;
+    }
+    size_t first = max(round_up(size, dsize), region_chunk_min) + overhead;
+
+    region_chunk_t *chunk = malloc(first);
+    if (chunk == NULL)
+    {
+        return NULL;
+    }
+    chunk->next = NULL;
+
+    region_t *r = (region_t *)(chunk + 1);
+    r->chunks = chunk;
+    r->cur = (char *)(r + 1);
+    r->end = (char *)chunk + first;
+    r->first_end = r->end;
+    r->next_size = min(2 * first, region_chunk_max);
+    dbg_printf("Region_create(%zd) --> %p\n", size, (void *)r);
+    return r;
+}
+
+/*
+ * mm_region_alloc: returns size bytes, 16-byte aligned, from region r, or
+ *                  NULL on failure. The memory stays valid until the region
+ *                  is reset or destroyed; objects cannot be freed one by one.
+ *                  Normally this is just a pointer bump.
+ */
+void *mm_region_alloc(region_t *r, size_t size)
+{
+    if (size > SIZE_MAX - dsize)
+    {
+        return NULL;
+    }
+    size = (size == 0) ? dsize : round_up(size, dsize);
+
+    if (size <= (size_t)(r->end - r->cur))
+    {
+        void *bp = r->cur;
+        r->cur += size;
+        return bp;
+    }
+    return region_grow(r, size);
+}
+
+/*
+ * mm_region_reset: frees every object of region r at once, with one free
+ *                  per chunk whatever the number of objects, keeping the
+ *                  first chunk for reuse.
+ */
+void mm_region_reset(region_t *r)
+{
+    region_chunk_t *chunk = r->chunks;
+
+    // The first chunk, which holds the region, is the last on the list
+    while (chunk->next != NULL)
+    {
+        region_chunk_t *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+
+    r->chunks = chunk;
+    r->cur = (char *)(r + 1);
+    r->end = r->first_end;
+    r->next_size = min(2 * (size_t)(r->first_end - (char *)chunk), region_chunk_max);
+    dbg_printf("Region_reset(%p)\n", (void *)r);
+}
+
+/*
+ * mm_region_destroy: frees region r and every object in it. Does nothing
+ *                    if r is NULL.
+ */
+void mm_region_destroy(region_t *r)
+{
+    if (r == NULL)
+    {
+        return;
+    }
+
+    region_chunk_t *chunk = r->chunks;
+    while (chunk != NULL)
+    {
+        region_chunk_t *next = chunk->next; // may free the region itself
+        free(chunk);
+        chunk = next;
+    }
+    dbg_printf("Region_destroy(%p)\n", (void *)r);
+}
+
+/*
+ * mm_profile_rate: samples about one allocation per rate bytes allocated
+ *                  from now on, or stops sampling if rate is 0. Samples
+ *                  already taken are kept. Does nothing unless MM_PROFILE
+ *                  is defined.
+ */
+void mm_profile_rate(size_t rate)
+{
+#ifdef MM_PROFILE
+    __atomic_store_n(&profile_rate, rate, __ATOMIC_RELAXED);
+    if (rate != 0)
+    {
+        profiler.left = profile_interval(rate);
+    }
+#endif
+}
+
+/*
+ * mm_profile_dump: prints the profile as folded stacks, one line per
+ *                  allocating stack, outermost frame first, followed by the
+ *                  estimated bytes it holds (live) or has ever allocated.
+ *                  Tools such as flamegraph.pl read this format.
+ */
+void mm_profile_dump(FILE *stream, bool live)
+{
+#ifdef MM_PROFILE
+    site_t site;
+    for (size_t i = 0; i < PROFILE_SITES; i++)
+    {
+        if (!profile_copy(i, &site))
+            continue;
+        uint64_t weight = live ? site.live_weight : site.alloc_weight;
+        if (weight == 0)
+            continue;
+
+        for (uint32_t d = site.depth; d-- > 0;)
+        {
+            profile_frame(stream, site.pcs[d]);
+            fputc(d > 0 ? ';' : ' ', stream);
+        }
+        fprintf(stream, "%llu\n", (unsigned long long)weight);
+    }
+#else
+    (void)live;
+    fprintf(stream, "# built without MM_PROFILE\n");
+#endif
+}
+
+/*
+ * mm_profile_dump_pprof: prints the profile in the legacy heap profile
+ *                        format that pprof reads, live and cumulative
+ *                        sample counts and bytes per stack, followed by the
+ *                        process's mappings so pprof can symbolize it:
+ *                            pprof <program> <file>
+ */
+void mm_profile_dump_pprof(FILE *stream)
+{
+#ifdef MM_PROFILE
+    site_t site;
+    uint64_t totals[4] = {0, 0, 0, 0};
+    for (size_t i = 0; i < PROFILE_SITES; i++)
+    {
+        if (!profile_copy(i, &site))
+            continue;
+        totals[0] += site.live_count;
+        totals[1] += site.live_bytes;
+        totals[2] += site.alloc_count;
+        totals[3] += site.alloc_bytes;
+    }
+    fprintf(stream, "heap profile: %llu: %llu [%llu: %llu] @ heap_v2/%zu\n",
+            (unsigned long long)totals[0], (unsigned long long)totals[1],
+            (unsigned long long)totals[2], (unsigned long long)totals[3],
+            __atomic_load_n(&profile_rate, __ATOMIC_RELAXED));
+
+    for (size_t i = 0; i < PROFILE_SITES; i++)
+    {
+        if (!profile_copy(i, &site))
+            continue;
+        fprintf(stream, "%llu: %llu [%llu: %llu] @",
+                (unsigned long long)site.live_count, (unsigned long long)site.live_bytes,
+                (unsigned long long)site.alloc_count, (unsigned long long)site.alloc_bytes);
+        for (uint32_t d = 0; d < site.depth; d++)
+            fprintf(stream, " %p", site.pcs[d]);
+        fputc('\n', stream);
+    }
+
+    // Copied with read(2), since reading through stdio would allocate
+    fprintf(stream, "\nMAPPED_LIBRARIES:\n");
+    int fd = open("/proc/self/maps", O_RDONLY);
+    if (fd >= 0)
+    {
+        char buf[4096];
+        ssize_t n;
+        while ((n = read(fd, buf, sizeof(buf))) > 0)
+            fwrite(buf, 1, (size_t)n, stream);
+        close(fd);
+    }
+#else
+    fprintf(stream, "# built without MM_PROFILE\n");
+#endif
+}
+
+/******** The remaining content below are helper and debug routines ********/
+
+/*
+ * arena_setup: lays out an empty heap starting at start, as mm_init
+ *              describes, and empties the arena's free lists. end is the
+ *              end of the arena's reservation, or NULL for the main arena.
+ */
+static void arena_setup(arena_t *a, word_t *start, char *end)
+{
+    start[0] = pack(0, true, true, false); // Prologue footer
+    start[1] = pack(0, true, true, false); // Epilogue header
+
+    // Forget any free lists left over from a previous heap
+    for (size_t i = 0; i < SEG_CLASSES; i++)
+    {
+        a->seg_lists[i] = NULL;
+        a->seg_tails[i] = NULL;
+    }
+    a->seg_bitmap = 0;
+    memset(a->fit_sizes, 0, sizeof(a->fit_sizes));
+    memset(a->fit_count, 0, sizeof(a->fit_count));
+    memset(a->fit_spill, 0, sizeof(a->fit_spill));
+    memset(a->fit_rover, 0, sizeof(a->fit_rover));
+
+    for (size_t i = 0; i < SLAB_CLASSES; i++)
+    {
+        a->slabs[i] = NULL;
+    }
+    a->slab_empty = NULL;
+
+    a->heap_start = (block_t *)&(start[1]);
+    a->heap_lo = (char *)start;
+    a->heap_brk = (char *)&(start[2]);
+    a->heap_end = end;
+    a->heap_clean = a->heap_brk;
+    a->heap_top = a->heap_brk;
+    a->check_at = NULL;
+    a->wild = NULL;
+    a->chunk = policy.grow_min;
+    a->segments = NULL;
+    a->pending = NULL;
+    a->merging = NULL;
+}
+
+/*
+ * arena_malloc: finds or makes room for a block of asize bytes in arena a
+ *               and allocates it. Returns the payload, or NULL if the arena
+ *               cannot grow. If dirty is not NULL, it is set to the number
+ *               of leading payload bytes that may be nonzero.
+ *               The caller holds the arena's lock.
+ */
+static void *arena_malloc(arena_t *a, size_t asize, size_t *dirty)
+{
+    // Search the free list for a fit
+    block_t *block = find_fit(a, asize);
+
+    // If no fit is found, take the wilderness, growing it if need be
+    if (block == NULL)
+    {
+        block = wild_fit(a, asize);
+        if (block == NULL) // the heap cannot grow
+        {
+            return NULL;
+        }
+    }
+
+    place(a, block, asize);
+
+    size_t nonzero = mark_used(a, block);
+    if (dirty != NULL)
+    {
+        *dirty = nonzero;
+    }
+    return header_to_payload(block);
+}
+
+/*
+ * arena_memalign: allocates a block of asize bytes in arena a whose payload
+ *                 is a multiple of align, a power of two above dsize. A
+ *                 block with room for the worst-case gap is found or made,
+ *                 and the gap before the aligned payload, always a multiple
+ *                 of dsize, is split off as a free block. Returns the
+ *                 payload, or NULL. The caller holds the arena's lock.
+ */
+static void *arena_memalign(arena_t *a, size_t align, size_t asize)
+{
+    size_t fsize = asize + align - dsize;
+    if (fsize < asize)
+    {
+        return NULL;
+    }
+
+    block_t *block = find_fit(a, fsize);
+    if (block == NULL)
+    {
+        block = wild_fit(a, fsize);
+        if (block == NULL)
+        {
+            return NULL;
+        }
+    }
+
+    char *bp = header_to_payload(block);
+    size_t gap = round_up((size_t)bp, align) - (size_t)bp;
+    if (gap > 0)
+    {
+        size_t csize = get_size(block);
+        block_t *aligned = (block_t *)((char *)block + gap);
+
+        // The gap keeps the block's place; the free block before a free
+        // block is allocated, so the gap needs no coalescing. Both halves
+        // are written before either is filed, since filing looks at the
+        // block that follows
+        list_remove(a, block);
+        write_header(block, gap, false, get_alloc_of_prev(block), get_prev_mini(block));
+        write_footer(block, gap, false);
+        write_header(aligned, csize - gap, false, false, gap == min_block_size);
+        write_footer(aligned, csize - gap, false);
+        prev_mini_make(find_next(aligned), csize - gap == min_block_size);
+        add(a, block);
+        add(a, aligned);
+        block = aligned;
+    }
+
+    place(a, block, asize);
+    mark_used(a, block);
+    return header_to_payload(block);
+}
+
+/*
+ * arena_malloc_batch: carves n allocated blocks of asize bytes, one after
+ *                     the other, out of a single free block of arena a
+ *                     that is found or made, and stores their payloads in
+ *                     ptrs. What is left of the free block stays free.
+ *                     Returns false, allocating nothing, if no such block
+ *                     can be had. The caller holds the arena's lock.
+ */
+static bool arena_malloc_batch(arena_t *a, size_t asize, size_t n, void **ptrs)
+{
+    size_t total = asize * n;
+    if (total / n != asize)
+    {
+        return false;
+    }
+
+    block_t *block = find_fit(a, total);
+    if (block == NULL)
+    {
+        block = wild_fit(a, total);
+        if (block == NULL)
+        {
+            return false;
+        }
+    }
+
+    size_t csize = get_size(block);
+    list_remove(a, block);
+
+    // The first block keeps the free block's prev bits; later ones follow
+    // an allocated block of asize bytes
+    write_header(block, asize, true, get_alloc_of_prev(block), get_prev_mini(block));
+    ptrs[0] = header_to_payload(block);
+    for (size_t i = 1; i < n; i++)
+    {
+        block = find_next(block);
+        write_header(block, asize, true, true, asize == min_block_size);
+        ptrs[i] = header_to_payload(block);
+    }
+    mark_used(a, block);
+
+    // Leave the rest free, or tell the next block it follows an allocated one
+    block_t *rest = find_next(block);
+    if (csize > total)
+    {
+        write_header(rest, csize - total, false, true, asize == min_block_size);
+        write_footer(rest, csize - total, false);
+        prev_mini_make(find_next(rest), csize - total == min_block_size);
+        add(a, rest);
+    }
+    else
+    {
+        prev_make(rest, true);
+        prev_mini_make(rest, asize == min_block_size);
+    }
+    return true;
+}
+
+/*
+ * mark_used: moves the arena's clean mark past a block that is being handed
+ *            out. Returns how many leading payload bytes may be nonzero.
+ */
+static size_t mark_used(arena_t *a, block_t *block)
+{
+    char *bp = header_to_payload(block);
+    char *end = (char *)find_next(block);
+    char **clean = clean_mark(a, block);
+    size_t nonzero = end - bp;
+
+    // Past the clean mark, only the block's free-list links and its footer
+    // as a free block may be nonzero
+    if (end > *clean)
+    {
+        size_t links = sizeof(block_t) - wsize;
+        nonzero = (*clean > bp) ? (size_t)(*clean - bp) : 0;
+        nonzero = max(nonzero, (links < (size_t)(end - bp)) ? links : (size_t)(end - bp));
+        *(word_t *)(end - wsize) = 0;
+        *clean = end;
+    }
+    return nonzero;
+}
+
+/*
+ * lazy_init: initializes the heap on first use. With MM_THREADS, only the
+ *            first thread to get here does it. Returns false if there is
+ *            still no heap, because the memory system gave none.
+ */
+static bool lazy_init(void)
+{
+#ifdef MM_THREADS
+    pthread_mutex_lock(&init_lock);
+    if (heap_listp == NULL)
+        mm_init();
+    pthread_mutex_unlock(&init_lock);
+#else
+    mm_init();
+#endif
+    return heap_listp != NULL;
+}
+
+#ifdef MM_THREADS
+/*
+ * fork_prepare: takes every lock before a fork, so that no other thread is
+ *               halfway through changing what they guard when the child's
+ *               copy of the heap is made.
+ */
+static void fork_prepare(void)
+{
+    pthread_mutex_lock(&maint_lock);
+    pthread_mutex_lock(&init_lock);
+    pthread_mutex_lock(&main_arena.lock);
+    for (size_t i = 1; i < MAX_ARENAS; i++)
+    {
+        if (arenas[i] != NULL)
+            pthread_mutex_lock(&arenas[i]->lock);
+    }
+    pthread_mutex_lock(&handle_lock);
+#ifdef MM_PROFILE
+    pthread_mutex_lock(&profile_lock);
+#endif
+}
+
+/*
+ * fork_release: drops the locks fork_prepare took, in the parent and in
+ *               the child alike; in the child only the forking thread is
+ *               left, and it is the one holding them.
+ */
+static void fork_release(void)
+{
+#ifdef MM_PROFILE
+    pthread_mutex_unlock(&profile_lock);
+#endif
+    pthread_mutex_unlock(&handle_lock);
+    for (size_t i = MAX_ARENAS - 1; i > 0; i--)
+    {
+        if (arenas[i] != NULL)
+            pthread_mutex_unlock(&arenas[i]->lock);
+    }
+    pthread_mutex_unlock(&main_arena.lock);
+    pthread_mutex_unlock(&init_lock);
+    pthread_mutex_unlock(&maint_lock);
+}
+
+/*
+ * fork_child: drops the locks in the child, which has no maintenance
+ *             thread even if the parent does; frees stay deferred, and
+ *             are merged when an arena runs short or by mm_maintain.
+ */
+static void fork_child(void)
+{
+    maint_running = false;
+    fork_release();
+}
+
+/*
+ * fork_register: installs the fork handlers when the program (or the
+ *                preloaded library) is loaded. Blocks cached by threads
+ *                that the child does not inherit are simply lost to it.
+ */
+__attribute__((constructor)) static void fork_register(void)
+{
+    pthread_atfork(fork_prepare, fork_release, fork_child);
+}
+#endif
+
+/*
+ * stat_add: adds n to one of the counters in stats. Does nothing unless
+ *           MM_STATS is defined; with threads, the add is atomic but
+ *           imposes no ordering.
+ */
+static void stat_add(uint64_t *counter, uint64_t n)
+{
+#ifdef MM_STATS
+#ifdef MM_THREADS
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+#else
+    *counter += n;
+#endif
+#endif
+}
+
+/*
+ * stat_hist: counts value in the power-of-two bucket it falls in.
+ */
+static void stat_hist(uint64_t *hist, size_t value)
+{
+#ifdef MM_STATS
+    size_t bucket = (value == 0) ? 0 : (size_t)(64 - __builtin_clzl(value));
+    stat_add(&hist[(bucket < STAT_BUCKETS) ? bucket : STAT_BUCKETS - 1], 1);
+#endif
+}
+
+/*
+ * stat_block: counts the bytes of a heap block or slab slot as handed out
+ *             (alloc) or given back. Mapped blocks are counted where they
+ *             are mapped and unmapped; NULL is ignored.
+ */
+static void stat_block(void *bp, bool alloc)
+{
+#ifdef MM_STATS
+    size_t size;
+    if (bp == NULL)
+        return;
+    if (is_slab(bp))
+        size = slab_of(bp)->slot_size;
+    else if (!get_mapped(payload_to_header(bp)))
+        size = get_size(payload_to_header(bp));
+    else
+        return;
+    stat_add(alloc ? &stats.alloc_bytes : &stats.freed_bytes, size);
+#endif
+}
+
+/*
+ * arena_free: marks the block free and coalesces it into arena a.
+ *             The caller holds the arena's lock.
+ */
+static void arena_free(arena_t *a, block_t *block)
+{
+    size_t size = get_size(block);
+
+    write_header(block, size, false, get_alloc_of_prev(block), get_prev_mini(block));
+    write_footer(block, size, false);
+
+    block_t *merged = coalesce(a, block);
+
+    // A segment left with one free block from fence to fence is unmapped
+    char *merged_end = (char *)find_next(merged);
+    if ((char *)merged < a->heap_lo || (char *)merged >= a->heap_brk)
+    {
+        segment_t *seg = segment_of(merged);
+        if (merged == seg->start && merged_end == (char *)seg + segment_size - wsize)
+        {
+            list_remove(a, merged);
+            segment_release(a, seg);
+            return;
+        }
+    }
+
+    // Give the pages of a large free region back; only the freed range can
+    // still be resident, the rest was released when it was freed
+    if (get_size(merged) >= trim_threshold)
+    {
+        if (a->heap_end != NULL && merged_end == a->heap_brk - wsize)
+        {
+            trim_top(a, top_pad);
+        }
+        release_block(merged, (char *)block, (char *)block + size);
+    }
+}
+
+/*
+ * pending_push: defers the free of block, which stays marked allocated, to
+ *               its arena a's maintenance. Takes no lock: with MM_THREADS
+ *               the push is a compare-and-swap, and since blocks only ever
+ *               leave the stack all at once, no other thread can pop and
+ *               push the head back in between.
+ */
+static void pending_push(arena_t *a, block_t *block)
+{
+    block_t **link = (block_t **)header_to_payload(block);
+#ifdef MM_THREADS
+    block_t *head = __atomic_load_n(&a->pending, __ATOMIC_RELAXED);
+    do
+    {
+        *link = head;
+    } while (!__atomic_compare_exchange_n(&a->pending, &head, block, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+#else
+    *link = a->pending;
+    a->pending = block;
+#endif
+}
+
+/*
+ * pending_merge: frees up to limit of arena a's pending blocks for real,
+ *                taking the whole pending stack over whenever the blocks
+ *                taken before are done. Returns how many were merged. The
+ *                caller holds the arena's lock.
+ */
+static size_t pending_merge(arena_t *a, size_t limit)
+{
+    size_t done = 0;
+
+    while (done < limit)
+    {
+        if (a->merging == NULL)
+        {
+#ifdef MM_THREADS
+            a->merging = __atomic_exchange_n(&a->pending, NULL, __ATOMIC_ACQUIRE);
+#else
+            a->merging = a->pending;
+            a->pending = NULL;
+#endif
+            if (a->merging == NULL)
+                break;
+        }
+        block_t *block = a->merging;
+        a->merging = *(block_t **)header_to_payload(block);
+        arena_free(a, block);
+        done++;
+    }
+    return done;
+}
+
+/*
+ * arena_maintain: merges arena a's pending blocks, maint_batch at a time
+ *                 under its lock, until none are left or the deadline has
+ *                 passed, and if there is time left then, refills the fit
+ *                 indexes of the range classes. Returns the number merged.
+ */
+static size_t arena_maintain(arena_t *a, uint64_t deadline)
+{
+    size_t merged = 0;
+    size_t done;
+
+    do
+    {
+        arena_lock(a);
+        done = pending_merge(a, maint_batch);
+        arena_unlock(a);
+        merged += done;
+    } while (done == maint_batch && now_us() < deadline);
+
+    if (done < maint_batch && policy_indexed() && now_us() < deadline)
+    {
+        arena_lock(a);
+        for (size_t range = 0; range < SEG_RANGES; range++)
+        {
+            fit_index_refill(a, range);
+        }
+        arena_unlock(a);
+    }
+    return merged;
+}
+
+// returns the time on the monotonic clock, in microseconds
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/*
+ * arena_of: returns the arena that owns the block. Blocks outside the main
+ *           heap belong to the arena named at the start of the aligned
+ *           reservation or segment that holds them.
+ */
+static arena_t *arena_of(block_t *block)
+{
+#ifdef MM_THREADS
+    char *p = (char *)block;
+    if (p < main_arena.heap_lo || p >= main_arena.heap_brk)
+    {
+        return segment_of(p)->arena;
+    }
+#endif
+    return &main_arena;
+}
+
+#ifdef MM_THREADS
+/*
+ * tcache_flush: returns every block in the exiting thread's cache to its
+ *               arena. Runs as the destructor of tcache_key.
+ */
+static void tcache_flush(void *arg)
+{
+    tcache_t *tc = (tcache_t *)arg;
+
+    arena_lock(tc->arena);
+    for (size_t cls = 0; cls < seg_exact_count; cls++)
+    {
+        while (tc->bins[cls] != NULL)
+        {
+            block_t *block = tc->bins[cls];
+            tc->bins[cls] = *(block_t **)header_to_payload(block);
+            arena_free(tc->arena, block);
+        }
+        // Full, so frees made by later destructors skip the cache
+        tc->counts[cls] = tcache_fill;
+    }
+    for (size_t slot = 0; slot < SLAB_CLASSES; slot++)
+    {
+        while (tc->slots[slot] != NULL)
+        {
+            void *bp = tc->slots[slot];
+            tc->slots[slot] = *(void **)bp;
+            slab_free(slab_of(bp), bp);
+        }
+        tc->slot_counts[slot] = tcache_fill;
+    }
+    arena_unlock(tc->arena);
+}
+
+/*
+ * arena_at: returns arena i, or NULL if it has not been created. Walkers
+ *           read arenas without init_lock, so the load pairs with the
+ *           release store that publishes a new arena.
+ */
+static arena_t *arena_at(size_t i)
+{
+    return (i == 0) ? &main_arena : __atomic_load_n(&arenas[i], __ATOMIC_ACQUIRE);
+}
+
+/*
+ * arena_create: reserves an aligned region of segment_size bytes and sets
+ *               up an empty arena at its start, after the segment_t that
+ *               names it. Returns NULL on failure.
+ */
+static arena_t *arena_create(void)
+{
+    char *base = segment_map();
+    if (base == NULL)
+    {
+        return NULL;
+    }
+
+    arena_t *a = (arena_t *)((segment_t *)base + 1);
+    ((segment_t *)base)->arena = a;
+    word_t *start = (word_t *)round_up((size_t)(a + 1), dsize);
+    arena_setup(a, start, base + segment_size);
+    pthread_mutex_init(&a->lock, NULL);
+
+    if (extend_heap(a, chunksize) == NULL)
+    {
+        munmap(base, segment_size);
+        return NULL;
+    }
+    return a;
+}
+#endif
+
+/*
+ * thread_arena: returns the arena of the calling thread. Threads are
+ *               assigned to arenas round-robin on their first allocation.
+ */
+static arena_t *thread_arena(void)
+{
+#ifdef MM_THREADS
+    if (tcache.arena == NULL)
+    {
+        size_t idx = __atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED) % arena_count;
+
+        pthread_mutex_lock(&init_lock);
+        if (!tcache_key_made)
+        {
+            tcache_key_made = (pthread_key_create(&tcache_key, tcache_flush) == 0);
+        }
+        if (arenas[idx] == NULL)
+        {
+            // Published only once it is set up, for walkers that take no lock
+            __atomic_store_n(&arenas[idx], arena_create(), __ATOMIC_RELEASE);
+        }
+        tcache.arena = (arenas[idx] != NULL) ? arenas[idx] : &main_arena;
+        pthread_mutex_unlock(&init_lock);
+
+        // Have the cache flushed when this thread exits
+        if (tcache_key_made)
+        {
+            pthread_setspecific(tcache_key, &tcache);
+        }
+    }
+    return tcache.arena;
+#else
+    return &main_arena;
+#endif
+}
+
+// Takes the arena's lock; a no-op unless built with MM_THREADS
+static void arena_lock(arena_t *a)
+{
+#ifdef MM_THREADS
+    pthread_mutex_lock(&a->lock);
+#endif
+}
+
+// Releases the arena's lock; a no-op unless built with MM_THREADS
+static void arena_unlock(arena_t *a)
+{
+#ifdef MM_THREADS
+    pthread_mutex_unlock(&a->lock);
+#endif
+}
+
+/*
+ * extend_heap: Extends the heap with the requested number of bytes, and
+ *              recreates epilogue header. Returns a pointer to the result of
+ *              coalescing the newly-created block with previous free block, if
+ *              applicable, or NULL in failure.
+ */
+static block_t *extend_heap(arena_t *a, size_t size)
+{
+    void *bp;
+    block_t *epilogue = (block_t *)(a->heap_brk - wsize);
+    bool old_alloc = get_alloc_of_prev(epilogue);
+    bool old_mini = get_prev_mini(epilogue);
+
+    // Allocate an even number of words to maintain alignment
+    size = round_up(size, dsize);
+#ifdef MM_HUGEPAGES
+    // Grow up to a huge page boundary, so that every huge page the heap
+    // reaches lies wholly inside it
+    size = round_up((size_t)a->heap_brk + size, huge_page) - (size_t)a->heap_brk;
+#endif
+    if (a->heap_end == NULL)
+    {
+        // Free-list links cannot reach past max_heap_span
+        if (size > max_heap_span - (size_t)(a->heap_brk - a->heap_lo))
+        {
+            return NULL;
+        }
+        if ((bp = mem_sbrk(size)) == (void *)-1)
+        {
+            return NULL;
+        }
+    }
+    else
+    {
+        // Extra arenas grow inside their own reservation
+        if (size > (size_t)(a->heap_end - a->heap_brk))
+        {
+            return NULL;
+        }
+        bp = a->heap_brk;
+    }
+    a->heap_brk = (char *)bp + size;
+    if (a->heap_top < a->heap_brk)
+    {
+        a->heap_top = a->heap_brk;
+    }
+    stat_add(&stats.heap_grows, 1);
+    stat_add(&stats.heap_grow_bytes, size);
+#ifdef MM_HUGEPAGES
+    // A hint only; without huge pages the heap works all the same
+    char *advise = (char *)((size_t)bp & ~(mem_pagesize() - 1));
+    madvise(advise, a->heap_brk - advise, MADV_HUGEPAGE);
+#endif
+
+    // Initialize free block header/footer
+    block_t *block = payload_to_header(bp);
+    write_header(block, size, false, old_alloc, old_mini);
+    write_footer(block, size, false);
+
+    // Create new epilogue header
+    block_t *block_next = find_next(block);
+    write_header(block_next, 0, true, false, size == min_block_size);
+
+    // Coalesce in case the previous block was free
+    return coalesce(a, block);
+}
+
+/*
+ * segment_map: maps segment_size bytes aligned to their own size, with no
+ *              swap charged to them until they are touched. Returns NULL
+ *              on failure.
+ */
+static char *segment_map(void)
+{
+    // Over-reserve so that an aligned region of the full size fits inside
+    char *raw = mmap(NULL, 2 * segment_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (raw == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    char *base = (char *)round_up((size_t)raw, segment_size);
+    if (base > raw)
+    {
+        munmap(raw, base - raw);
+    }
+    munmap(base + segment_size, raw + segment_size - base);
+    return base;
+}
+
+/*
+ * segment_add: maps a segment for arena a, whose heap cannot grow, and
+ *              files the free block that fills it. Returns the block, or
+ *              NULL if it would hold less than asize bytes or no segment
+ *              can be mapped within reach of the arena's free-list links.
+ *              The caller holds the arena's lock.
+ */
+static block_t *segment_add(arena_t *a, size_t asize)
+{
+    size_t fences = round_up(sizeof(segment_t), dsize) + dsize;
+    if (asize > segment_size - fences)
+    {
+        return NULL;
+    }
+
+    char *base = segment_map();
+    if (base == NULL)
+    {
+        return NULL;
+    }
+    char *link_base = a->heap_lo - wsize;
+    size_t reach = (base < link_base) ? (size_t)(link_base - base)
+                                      : (size_t)(base + segment_size - link_base);
+    if (reach >= max_heap_span)
+    {
+        munmap(base, segment_size);
+        return NULL;
+    }
+#ifdef MM_HUGEPAGES
+    madvise(base, segment_size, MADV_HUGEPAGE);
+#endif
+
+    // Prologue footer, one free block, and the epilogue header in the
+    // segment's last word
+    segment_t *seg = (segment_t *)base;
+    word_t *start = (word_t *)round_up((size_t)(seg + 1), dsize);
+    block_t *block = (block_t *)&start[1];
+    size_t size = segment_size - fences;
+    start[0] = pack(0, true, true, false);
+    write_header(block, size, false, true, false);
+    write_footer(block, size, false);
+    write_header(find_next(block), 0, true, false, false);
+
+    seg->arena = a;
+    seg->start = block;
+    seg->clean = (char *)block; // fresh mappings are zero
+    seg->prev = NULL;
+    seg->next = a->segments;
+    if (a->segments != NULL)
+    {
+        a->segments->prev = seg;
+    }
+    a->segments = seg;
+    stat_add(&stats.heap_grows, 1);
+    stat_add(&stats.heap_grow_bytes, segment_size);
+
+    add(a, block);
+    return block;
+}
+
+/*
+ * segment_release: takes a segment off arena a's list and unmaps it. Its
+ *                  blocks must be of no further use to the arena.
+ */
+static void segment_release(arena_t *a, segment_t *seg)
+{
+    if (seg->prev != NULL)
+    {
+        seg->prev->next = seg->next;
+    }
+    else
+    {
+        a->segments = seg->next;
+    }
+    if (seg->next != NULL)
+    {
+        seg->next->prev = seg->prev;
+    }
+
+    // The incremental checker starts over rather than resume inside it
+    char *check_at = (char *)a->check_at;
+    if (check_at > (char *)seg && check_at < (char *)seg + segment_size)
+    {
+        a->check_at = NULL;
+    }
+    munmap(seg, segment_size);
+}
+
+/*
+ * segment_of: returns the segment, or the extra arena's reservation, that
+ *             holds p, an address outside the main heap.
+ */
+static segment_t *segment_of(void *p)
+{
+    return (segment_t *)((uintptr_t)p & ~(uintptr_t)(segment_size - 1));
+}
+
+/*
+ * next_part: returns the first block of the part of arena a's heap that
+ *            follows the one whose epilogue a walk has reached: the heap
+ *            itself comes first, then each segment. Returns NULL after the
+ *            last one.
+ */
+static block_t *next_part(arena_t *a, block_t *epilogue)
+{
+    segment_t *seg = ((char *)epilogue == a->heap_brk - wsize) ? a->segments
+                                                               : segment_of(epilogue)->next;
+    return (seg != NULL) ? seg->start : NULL;
+}
+
+/*
+ * clean_mark: returns where the clean mark that covers heap address p is
+ *             kept: in arena a for its heap, in the segment otherwise.
+ */
+static char **clean_mark(arena_t *a, void *p)
+{
+    if ((char *)p >= a->heap_lo && (char *)p < a->heap_brk)
+    {
+        return &a->heap_clean;
+    }
+    return &segment_of(p)->clean;
+}
+
+/*
+ * heap_bytes: returns the bytes of arena a's heap and segments.
+ *             The caller holds the arena's lock.
+ */
+static size_t heap_bytes(arena_t *a)
+{
+    size_t bytes = a->heap_brk - a->heap_lo;
+    for (segment_t *seg = a->segments; seg != NULL; seg = seg->next)
+    {
+        bytes += segment_size;
+    }
+    return bytes;
+}
+
+/* Coalesce: Coalesces current block with previous and next blocks if
+ *           either or both are unallocated; otherwise the block is not
+ *           modified. Then, insert coalesced block into the segregated list.
+ *           Returns pointer to the coalesced block. After coalescing, the
+ *           immediate contiguous previous and next blocks must be allocated.
+ *           The block after the result learns that its predecessor is free,
+ *           and whether it is a mini block.
+ */
+static block_t *coalesce(arena_t *a, block_t *block)
+{
+    block_t *block_next = find_next(block);
+
+    bool prev_alloc = get_alloc_of_prev(block);
+    bool next_alloc = get_alloc(block_next);
+    size_t size = get_size(block);
+
+    stat_add(&stats.coalesce_cases[(prev_alloc ? 0 : 2) + (next_alloc ? 0 : 1)], 1);
+
+    // case 1: both previous and next blocks are allocated
+    if (prev_alloc && next_alloc)
+    {
+        write_header(block, size, false, get_alloc_of_prev(block), get_prev_mini(block));
+        write_footer(block, size, false);
+    }
+
+    // case 2: previous block is allocated, next block is free
+    else if (prev_alloc && !next_alloc)
+    {
+        list_remove(a, block_next);   // remove next block from free list
+        size += get_size(block_next); // increase size to include next block
+        merged(a, block_next, block);
+        clear_tags(a, block_next);
+        write_header(block, size, false, true, get_prev_mini(block));
+        write_footer(block, size, false);
+    }
+
+    // case 3: previous block is free, next block is allocated
+    else if (!prev_alloc && next_alloc)
+    {
+        block_t *block_prev = find_prev(block);
+        list_remove(a, block_prev);   // remove previous block from free list
+        size += get_size(block_prev); // increase size to include previous block
+        merged(a, block, block_prev);
+        clear_tags(a, block);
+        write_header(block_prev, size, false, true, get_prev_mini(block_prev));
+        write_footer(block_prev, size, false);
+        block = block_prev; // update current block to previous block
+    }
+
+    // case 4: both previous and next blocks are free
+    else
+    {
+        block_t *block_prev = find_prev(block);
+        list_remove(a, block_prev); // remove previous block from free list
+        list_remove(a, block_next); // remove next block from free list
+        size += get_size(block_next) + get_size(block_prev); // combine sizes of prev, current, and next blocks
+        merged(a, block_next, block_prev);
+        merged(a, block, block_prev);
+        clear_tags(a, block_next);
+        clear_tags(a, block);
+        write_header(block_prev, size, false, true, get_prev_mini(block_prev));
+        write_footer(block_prev, size, false);
+        block = block_prev; // update current block to previous block
+    }
+
+    // The block after the coalesced one now follows a free block
+    block_next = find_next(block);
+    prev_make(block_next, false);
+    prev_mini_make(block_next, size == min_block_size);
+
+    add(a, block); // add the coalesced block to free list
+    return block;  // return the coalesced block
+}
+
+/*
+ * clear_tags: zeroes the header and links of a block that is merged into
+ *             the free block before it, and that block's footer, if they
+ *             lie past the clean mark, so the merged block reads as zero
+ *             there but for its own tags. The words are dead after merging.
+ */
+static void clear_tags(arena_t *a, block_t *block)
+{
+    if ((char *)block < *clean_mark(a, block))
+    {
+        return;
+    }
+
+    size_t size = get_size(block);
+    word_t *words = (word_t *)block - 1;
+    size_t count = 1 + ((size < sizeof(block_t)) ? size : sizeof(block_t)) / wsize;
+    for (size_t i = 0; i < count; i++)
+    {
+        words[i] = 0;
+    }
+}
+
+/*
+ * merged: notes that block is about to become part of the block into,
+ *         which lies before it. If the incremental checker stopped at
+ *         block, it resumes from into instead, so it never starts a walk
+ *         in the middle of a block.
+ */
+static void merged(arena_t *a, block_t *block, block_t *into)
+{
+    if (a->check_at == block)
+    {
+        a->check_at = into;
+    }
+}
+
+/*
+ * place: Places block with size of asize at the start of bp. If the remaining
+ *        size is at least the policy's split_min, then split the block to the
+ *        the allocated block and the remaining block as free, which is then
+ *        inserted into the segregated list. Requires that the block is
+ *        initially unallocated.
+ */
+static void place(arena_t *a, block_t *block, size_t asize)
+{
+    size_t csize = get_size(block);
+
+    // Remove the current block from the free list, as it's about to be allocated
+    list_remove(a, block);
+
+    // Check if the remaining space after allocation is large enough to split off
+    if ((csize - asize) >= policy.split_min)
+    {
+        block_t *block_next;
+
+        // Mark the current block as allocated; an aligned block may follow
+        // the free gap split off in front of it
+        write_header(block, asize, true, get_alloc_of_prev(block), get_prev_mini(block));
+
+        // Find and prepare the next block as a new free block
+        block_next = find_next(block);
+        write_header(block_next, csize - asize, false, true, asize == min_block_size);
+        write_footer(block_next, csize - asize, false);
+
+        // The block after it may now follow a mini block
+        prev_mini_make(find_next(block_next), csize - asize == min_block_size);
+
+        // Add the new free block to the free list
+        add(a, block_next);
+    }
+    else
+    {
+        // If the remaining space is not large enough, allocate the entire block
+        write_header(block, csize, true, get_alloc_of_prev(block), get_prev_mini(block));
+
+        // Update the allocation status of the next block
+        prev_make(find_next(block), true);
+    }
+}
+
+/*
+ * size_class: returns the index of the segregated list that holds blocks of
+ *             size asize. Sizes up to seg_exact_max map to one class per
+ *             multiple of dsize; above that, class boundaries double, and
+ *             sizes above seg_range_max all belong to the tree.
+ */
+static size_t size_class(size_t asize)
+{
+    if (asize <= seg_exact_max)
+    {
+        return (asize - min_block_size) / dsize;
+    }
+    if (asize > seg_range_max)
+    {
+        return tree_class;
+    }
+
+    // (512, 1024] -> first range class, (1024, 2048] -> next, and so on
+    size_t log = (size_t)(63 - __builtin_clzl(asize - 1));
+    return seg_exact_count + (log - seg_exact_log);
+}
+
+/*
+ * split_tail: Shrinks the allocated block to asize bytes. If what is left
+ *             is at least the policy's split_min, it becomes a free block
+ *             that is coalesced with its successor and put on the free list;
+ *             otherwise the block keeps its full size.
+ */
+static void split_tail(arena_t *a, block_t *block, size_t asize)
+{
+    size_t csize = get_size(block);
+
+    if ((csize - asize) < policy.split_min)
+    {
+        return;
+    }
+
+    // Keep the block's own prev bits; it may follow a free block
+    write_header(block, asize, true, get_alloc_of_prev(block), get_prev_mini(block));
+
+    block_t *block_next = find_next(block);
+    write_header(block_next, csize - asize, false, true, asize == min_block_size);
+    write_footer(block_next, csize - asize, false);
+    coalesce(a, block_next);
+}
+
+/*
+ * grow_in_place: Tries to enlarge the allocated block to at least asize
+ *                bytes without moving it, by absorbing the free block after
+ *                it and, if the block is the last one before the epilogue,
+ *                by extending the heap by only the missing amount.
+ *                Returns true on success; on failure the block is unchanged.
+ */
+static bool grow_in_place(arena_t *a, block_t *block, size_t asize)
+{
+    size_t csize = get_size(block);
+    block_t *block_next = find_next(block);
+    size_t avail = csize;
+    block_t *tail = block_next;
+
+    // The free successor, if any, counts towards the new size
+    if (!get_alloc(block_next))
+    {
+        avail += get_size(block_next);
+        tail = find_next(block_next);
+    }
+
+    if (avail < asize)
+    {
+        // Only a block that ends at the heap's epilogue can grow the heap;
+        // a segment's cannot
+        if ((char *)tail != a->heap_brk - wsize)
+        {
+            return false;
+        }
+        // extend_heap coalesces the new memory with a free successor; it
+        // must still add at least a minimum-sized block of its own
+        block_next = extend_heap(a, max(asize - avail, min_block_size));
+        if (block_next == NULL)
+        {
+            return false;
+        }
+    }
+
+    // Absorb the free successor into the allocated block
+    size_t nsize = get_size(block_next);
+    list_remove(a, block_next);
+    merged(a, block_next, block);
+    write_header(block, csize + nsize, true, get_alloc_of_prev(block), get_prev_mini(block));
+    prev_make(find_next(block), true);
+    prev_mini_make(find_next(block), false);
+
+    // The block's new tail is handed out, so it is no longer clean
+    char **clean = clean_mark(a, block);
+    if ((char *)find_next(block) > *clean)
+    {
+        *clean = (char *)find_next(block);
+    }
+    return true;
+}
+
+/*
+ * map_block: allocates a block of at least size payload bytes in a mapping
+ *            of its own, with the payload a multiple of align (a power of
+ *            two, at least dsize). The payload is the first aligned address
+ *            past the lead word and the header; whole pages in front of
+ *            them are unmapped again. Returns the payload, or NULL.
+ */
+static void *map_block(size_t size, size_t align)
+{
+    size_t maplen = round_up(size + align, mem_pagesize());
+
+    // Guard against size + align wrapping around
+    if (maplen < size)
+    {
+        return NULL;
+    }
+
+    char *start = mmap(NULL, maplen, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (start == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    char *bp = (char *)round_up((size_t)start + dsize, align);
+    size_t waste = (size_t)(bp - dsize - start) / mem_pagesize() * mem_pagesize();
+    if (waste > 0)
+    {
+        munmap(start, waste);
+        start += waste;
+        maplen -= waste;
+    }
+
+    // The word before the header holds the distance from the mapping to it
+    block_t *block = payload_to_header(bp);
+    *((word_t *)block - 1) = (char *)block - start;
+    block->header = pack(maplen, true, true, false) | mapped_bit;
+    stat_add(&stats.maps, 1);
+    stat_add(&stats.map_bytes, maplen);
+    count_mapped(maplen, 0);
+    return bp;
+}
+
+#ifdef MM_PROFILE
+/*
+ * approx_log: returns the natural log of u, in (0, 1], to about five
+ *             digits, without libm: the exponent from the bits, the
+ *             mantissa from a short series.
+ */
+static double approx_log(double u)
+{
+    uint64_t bits;
+    memcpy(&bits, &u, sizeof(bits));
+    int exp = (int)((bits >> 52) & 0x7ff) - 1023;
+    bits = (bits & 0x000fffffffffffffULL) | 0x3ff0000000000000ULL;
+
+    double m;
+    memcpy(&m, &bits, sizeof(m));
+    double t = (m - 1) / (m + 1);
+    double t2 = t * t;
+    return exp * 0.6931471805599453 + 2 * t * (1 + t2 * (1.0 / 3 + t2 * (1.0 / 5 + t2 / 7)));
+}
+
+/*
+ * approx_exp_neg: returns e^-x for x >= 0 to about five digits, without libm:
+ *             x is split into a power of two, set in the exponent bits,
+ *             and a remainder below ln 2, taken from a short series.
+ */
+static double approx_exp_neg(double x)
+{
+    if (x > 700)
+    {
+        return 0;
+    }
+    int k = (int)(x / 0.6931471805599453);
+    double r = x - k * 0.6931471805599453;
+    double e = 1 - r * (1 - r / 2 * (1 - r / 3 * (1 - r / 4 * (1 - r / 5 * (1 - r / 6 * (1 - r / 7))))));
+
+    uint64_t bits = (uint64_t)(1023 - k) << 52;
+    double scale;
+    memcpy(&scale, &bits, sizeof(scale));
+    return e * scale;
+}
+
+/*
+ * profile_interval: returns the bytes until the thread's next sample,
+ *                   drawn from an exponential distribution with mean rate.
+ */
+static size_t profile_interval(size_t rate)
+{
+    if (profiler.rng == 0)
+    {
+        profiler.rng = (uintptr_t)&profiler ^ 0x9e3779b97f4a7c15ULL;
+    }
+    profiler.rng ^= profiler.rng << 13;
+    profiler.rng ^= profiler.rng >> 7;
+    profiler.rng ^= profiler.rng << 17;
+
+    double u = (double)((profiler.rng >> 11) + 1) / 9007199254740992.0;
+    return (size_t)(-approx_log(u) * (double)rate) + 1;
+}
+
+static void profile_lock_take(void)
+{
+#ifdef MM_THREADS
+    pthread_mutex_lock(&profile_lock);
+#endif
+}
+
+static void profile_lock_drop(void)
+{
+#ifdef MM_THREADS
+    pthread_mutex_unlock(&profile_lock);
+#endif
+}
+
+/*
+ * profile_sample: records block bp of size bytes as a sample of the stack
+ *                 that allocated it. Kept out of line so that it is always
+ *                 the one frame to drop from the top of the stack.
+ */
+static __attribute__((noinline)) void profile_sample(void *bp, size_t size, size_t rate)
+{
+    void *pcs[PROFILE_DEPTH + 1];
+    int depth = backtrace(pcs, PROFILE_DEPTH + 1) - 1;
+    if (depth <= 0)
+    {
+        return;
+    }
+
+    // FNV-1a over the return addresses
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (int i = 1; i <= depth; i++)
+    {
+        hash = (hash ^ (uintptr_t)pcs[i]) * 0x100000001b3ULL;
+    }
+    hash |= 1; // never 0, which marks an unused site
+
+    // A block of size bytes is sampled with probability 1 - e^(-size/rate),
+    // so it stands for size over that many bytes
+    double p = 1 - approx_exp_neg((double)size / (double)rate);
+    size_t weight = (p > 0) ? (size_t)((double)size / p) : rate;
+
+    profile_lock_take();
+    size_t s = hash & (PROFILE_SITES - 1);
+    site_t *site = NULL;
+    for (size_t probes = 0; probes < PROFILE_SITES; probes++, s = (s + 1) & (PROFILE_SITES - 1))
+    {
+        site_t *cand = &profile_sites[s];
+        if (cand->hash == 0)
+        {
+            cand->hash = hash;
+            cand->depth = (uint32_t)depth;
+            memcpy(cand->pcs, pcs + 1, depth * sizeof(void *));
+            site = cand;
+            break;
+        }
+        if (cand->hash == hash && cand->depth == (uint32_t)depth &&
+            memcmp(cand->pcs, pcs + 1, depth * sizeof(void *)) == 0)
+        {
+            site = cand;
+            break;
+        }
+    }
+
+    if (site != NULL)
+    {
+        site->alloc_count++;
+        site->alloc_bytes += size;
+        site->alloc_weight += weight;
+
+        // Remember the block only if there is room to, so free finds it
+        if (profile_live < PROFILE_SAMPLES / 2)
+        {
+            size_t i = ((uintptr_t)bp >> 4) & (PROFILE_SAMPLES - 1);
+            while (profile_samples[i].ptr != NULL)
+            {
+                i = (i + 1) & (PROFILE_SAMPLES - 1);
+            }
+            profile_samples[i] = (sample_t){bp, (uint32_t)(site - profile_sites), size, weight};
+            __atomic_store_n(&profile_live, profile_live + 1, __ATOMIC_RELAXED);
+            site->live_count++;
+            site->live_bytes += size;
+            site->live_weight += weight;
+        }
+    }
+    profile_lock_drop();
+}
+
+/*
+ * profile_find: returns the index of bp in the table of samples, or -1.
+ *               The caller holds the profile lock.
+ */
+static long profile_find(void *bp)
+{
+    size_t i = ((uintptr_t)bp >> 4) & (PROFILE_SAMPLES - 1);
+    while (profile_samples[i].ptr != NULL)
+    {
+        if (profile_samples[i].ptr == bp)
+        {
+            return (long)i;
+        }
+        i = (i + 1) & (PROFILE_SAMPLES - 1);
+    }
+    return -1;
+}
+
+/*
+ * profile_delete: takes sample i out of the table, moving later entries of
+ *                 the same probe run back so that none is cut off from its
+ *                 home slot. The caller holds the profile lock.
+ */
+static void profile_delete(size_t i)
+{
+    size_t j = i;
+    for (;;)
+    {
+        j = (j + 1) & (PROFILE_SAMPLES - 1);
+        if (profile_samples[j].ptr == NULL)
+        {
+            break;
+        }
+        // An entry may fill the hole unless its home lies in (i, j]
+        size_t home = ((uintptr_t)profile_samples[j].ptr >> 4) & (PROFILE_SAMPLES - 1);
+        if (((j - home) & (PROFILE_SAMPLES - 1)) >= ((j - i) & (PROFILE_SAMPLES - 1)))
+        {
+            profile_samples[i] = profile_samples[j];
+            i = j;
+        }
+    }
+    profile_samples[i].ptr = NULL;
+    __atomic_store_n(&profile_live, profile_live - 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * profile_copy: copies site i out under the lock, so that it can be
+ *               printed without holding it: printing may allocate.
+ *               Returns false for an unused site.
+ */
+static bool profile_copy(size_t i, site_t *copy)
+{
+    profile_lock_take();
+    *copy = profile_sites[i];
+    profile_lock_drop();
+    return copy->hash != 0;
+}
+
+/*
+ * profile_frame: prints one return address as a symbol and offset, or as
+ *                an offset into its object file if it has no symbol.
+ */
+static void profile_frame(FILE *stream, void *pc)
+{
+    Dl_info info;
+    bool found = dladdr(pc, &info) != 0; // info is only filled in if found
+    if (found && info.dli_sname != NULL)
+    {
+        fprintf(stream, "%s+0x%lx", info.dli_sname, (unsigned long)((char *)pc - (char *)info.dli_saddr));
+    }
+    else if (found && info.dli_fname != NULL && info.dli_fbase != NULL)
+    {
+        const char *name = strrchr(info.dli_fname, '/');
+        fprintf(stream, "%s+0x%lx", name ? name + 1 : info.dli_fname,
+                (unsigned long)((char *)pc - (char *)info.dli_fbase));
+    }
+    else
+    {
+        fprintf(stream, "%p", pc);
+    }
+}
+#endif
+
+/*
+ * profile_alloc: counts size bytes allocated at bp towards the thread's
+ *                next sample, and takes the sample when it is due. Does
+ *                nothing unless MM_PROFILE is defined and profiling is on.
+ */
+static inline void profile_alloc(void *bp, size_t size)
+{
+#ifdef MM_PROFILE
+    size_t rate = __atomic_load_n(&profile_rate, __ATOMIC_RELAXED);
+    if (bp == NULL || rate == 0)
+        return;
+    if (size < profiler.left)
+    {
+        profiler.left -= size;
+        return;
+    }
+
+    // backtrace may allocate the first time; that is not sampled
+    profiler.left = profile_interval(rate);
+    if (!profiler.busy)
+    {
+        profiler.busy = true;
+        profile_sample(bp, size, rate);
+        profiler.busy = false;
+    }
+#endif
+}
+
+/*
+ * profile_free: takes bp off the live profile if it was sampled. Costs a
+ *               single load while no sample is live.
+ */
+static void profile_free(void *bp)
+{
+#ifdef MM_PROFILE
+    if (__atomic_load_n(&profile_live, __ATOMIC_RELAXED) == 0)
+        return;
+
+    profile_lock_take();
+    long i = profile_find(bp);
+    if (i >= 0)
+    {
+        site_t *site = &profile_sites[profile_samples[i].site];
+        site->live_count--;
+        site->live_bytes -= profile_samples[i].size;
+        site->live_weight -= profile_samples[i].weight;
+        profile_delete((size_t)i);
+    }
+    profile_lock_drop();
+#endif
+}
+
+/*
+ * profile_move: a sampled block that realloc moved without freeing it
+ *               stays sampled at its new address.
+ */
+static void profile_move(void *old, void *bp)
+{
+#ifdef MM_PROFILE
+    if (old == bp || __atomic_load_n(&profile_live, __ATOMIC_RELAXED) == 0)
+        return;
+
+    profile_lock_take();
+    long i = profile_find(old);
+    if (i >= 0)
+    {
+        sample_t sample = profile_samples[i];
+        profile_delete((size_t)i);
+
+        size_t j = ((uintptr_t)bp >> 4) & (PROFILE_SAMPLES - 1);
+        while (profile_samples[j].ptr != NULL)
+        {
+            j = (j + 1) & (PROFILE_SAMPLES - 1);
+        }
+        sample.ptr = bp;
+        profile_samples[j] = sample;
+        __atomic_store_n(&profile_live, profile_live + 1, __ATOMIC_RELAXED);
+    }
+    profile_lock_drop();
+#endif
+}
+
+/*
+ * count_mapped: keeps mapped_bytes up to date as mappings come and go.
+ */
+static void count_mapped(size_t add, size_t sub)
+{
+#ifdef MM_THREADS
+    __atomic_fetch_add(&mapped_bytes, add - sub, __ATOMIC_RELAXED);
+#else
+    mapped_bytes += add - sub;
+#endif
+}
+
+/*
+ * unmap_block: returns the whole mapping of a mapped block to the OS.
+ */
+static void unmap_block(block_t *block)
+{
+    word_t lead = *find_prev_footer(block);
+    stat_add(&stats.unmaps, 1);
+    stat_add(&stats.unmap_bytes, get_size(block));
+    count_mapped(0, get_size(block));
+    munmap((char *)block - lead, get_size(block));
+}
+
+/*
+ * remap_block: resizes the mapping of a mapped block so that it holds at
+ *              least size payload bytes, letting the kernel move the pages
+ *              instead of copying them. Returns the (possibly moved)
+ *              payload, or NULL with the block untouched on failure.
+ */
+static void *remap_block(block_t *block, size_t size)
+{
+    word_t lead = *find_prev_footer(block);
+    size_t maplen = round_up(size + lead + wsize, mem_pagesize());
+    char *start = (char *)block - lead;
+
+    if (maplen < size)
+    {
+        return NULL;
+    }
+
+    if (maplen != get_size(block))
+    {
+        size_t oldlen = get_size(block);
+        start = mremap(start, oldlen, maplen, MREMAP_MAYMOVE);
+        if (start == MAP_FAILED)
+        {
+            return NULL;
+        }
+        stat_add(&stats.remaps, 1);
+        stat_add(&stats.unmap_bytes, oldlen);
+        stat_add(&stats.map_bytes, maplen);
+        count_mapped(maplen, oldlen);
+        block = (block_t *)(start + lead);
+        block->header = pack(maplen, true, true, false) | mapped_bit;
+    }
+    return header_to_payload(block);
+}
+
+/*
+ * mm_set_policy: sets the placement policy (see mm.h) of the next heap
+ *                mm_init builds; a heap keeps the policy it was built with.
+ *                split_min is rounded up to a multiple of dsize, and the
+ *                growth bounds likewise. Returns false, changing nothing, if
+ *                the policy is invalid or was fixed with MM_POLICY.
+ */
+bool mm_set_policy(const mm_policy_t *p)
+{
+#ifdef MM_POLICY
+    (void)p;
+    return false;
+#else
+    if ((unsigned)p->fit > MM_FIT_GOOD || (unsigned)p->insert > MM_INSERT_ADDRESS ||
+        p->fit_bound == 0 || p->good_shift >= 16 || p->grow_min == 0 ||
+        p->grow_max < p->grow_min || p->grow_max > max_heap_span)
+    {
+        return false;
+    }
+
+    policy_next = *p;
+    policy_next.split_min = round_up(max(p->split_min, min_block_size), dsize);
+    policy_next.grow_min = round_up(p->grow_min, dsize);
+    policy_next.grow_max = round_up(p->grow_max, dsize);
+    return true;
+#endif
+}
+
+/*
+ * mm_get_policy: returns the policy of the current heap in *p.
+ */
+void mm_get_policy(mm_policy_t *p)
+{
+    *p = policy;
+}
+
+/*
+ * mm_set_mmap_threshold: sets the request size, in bytes, from which blocks
+ *                        are given mappings of their own instead of coming
+ *                        from the heap.
+ */
+void mm_set_mmap_threshold(size_t size)
+{
+    mmap_threshold = size;
+}
+
+/*
+ * mm_set_trim_threshold: sets the size of a coalesced free block, in bytes,
+ *                        from which free releases its pages to the OS.
+ */
+void mm_set_trim_threshold(size_t size)
+{
+    trim_threshold = size;
+}
+
+/*
+ * mm_set_deferred_free: whether free leaves coalescing to mm_maintain. On
+ *                       turning deferral off, every pending free is merged;
+ *                       a free racing with the change may still be left
+ *                       for the next mm_maintain or for malloc to merge.
+ */
+void mm_set_deferred_free(bool on)
+{
+    __atomic_store_n(&defer_frees, on, __ATOMIC_RELAXED);
+    if (!on)
+    {
+        mm_maintain(0);
+    }
+}
+
+/*
+ * mm_set_deep_check: whether mm_checkheap scans all of the free memory past
+ *                    the clean mark for stray data, at a cost that grows
+ *                    with the size of the heap, instead of the first
+ *                    step_scan_limit bytes of each block.
+ */
+void mm_set_deep_check(bool on)
+{
+    deep_check = on;
+}
+
+/*
+ * release_pages: releases the whole pages inside [lo, hi) to the OS; they
+ *                read back as zero when next touched. Returns the number of
+ *                bytes released.
+ */
+static size_t release_pages(char *lo, char *hi)
+{
+    size_t page = mem_pagesize();
+    char *start = (char *)round_up((size_t)lo, page);
+    char *end = (char *)((size_t)hi & ~(page - 1));
+
+    if (end <= start || madvise(start, end - start, MADV_DONTNEED) != 0)
+    {
+        return 0;
+    }
+    stat_add(&stats.released_bytes, end - start);
+    return end - start;
+}
+
+/*
+ * heap_page: returns the unit in which heaps give memory back: a huge page
+ *            with MM_HUGEPAGES, so that none still in use is split, or
+ *            else a page.
+ */
+static size_t heap_page(void)
+{
+#ifdef MM_HUGEPAGES
+    return huge_page;
+#else
+    return mem_pagesize();
+#endif
+}
+
+/*
+ * release_block: releases the whole heap pages of the free block that lie
+ *                inside [lo, hi), sparing the header and list links at its
+ *                start and the footer at its end. Returns the bytes released.
+ */
+static size_t release_block(block_t *block, char *lo, char *hi)
+{
+    char *first = (char *)block + sizeof(block_t);
+    char *last = (char *)find_next(block) - wsize;
+    size_t unit = heap_page();
+
+    lo = (char *)round_up((size_t)((lo > first) ? lo : first), unit);
+    hi = (char *)((size_t)((hi < last) ? hi : last) & ~(unit - 1));
+    return release_pages(lo, hi);
+}
+
+/*
+ * trim_top: if the last block of the arena is free, keeps its first pad
+ *           bytes and gives the rest back. An extra arena lowers its break
+ *           to the next page boundary and moves the epilogue down; the main
+ *           arena cannot shrink through mem_sbrk, so it releases the pages.
+ *           Returns the bytes released.
+ */
+static size_t trim_top(arena_t *a, size_t pad)
+{
+    block_t *epilogue = (block_t *)(a->heap_brk - wsize);
+    if (get_alloc_of_prev(epilogue))
+    {
+        return 0;
+    }
+
+    block_t *top = find_prev(epilogue);
+    char *keep = (char *)top + max(round_up(pad, dsize), min_block_size);
+
+    // The heap is shrinking, so its next growth starts small again
+    a->chunk = policy.grow_min;
+
+    if (a->heap_end == NULL)
+    {
+        return release_block(top, keep, a->heap_brk);
+    }
+
+    // The new break is page aligned, so the shrunk top stays 16-byte sized
+    char *new_brk = (char *)round_up((size_t)keep + wsize, heap_page());
+    if (new_brk >= a->heap_brk)
+    {
+        return 0;
+    }
+
+    size_t released = release_pages(new_brk, a->heap_brk);
+    size_t size = new_brk - wsize - (char *)top;
+
+    // Released pages read as zero, but the partial page at the old break
+    // keeps the old top's data and tags, which no block owns any more; it
+    // is cleared by hand. If nothing was released, the mark stays put
+    char *tail = (char *)((size_t)a->heap_brk & ~(mem_pagesize() - 1));
+    bool cleared = released > 0 || tail <= new_brk;
+    if (cleared)
+    {
+        tail = (tail > new_brk) ? tail : new_brk;
+        memset(tail, 0, a->heap_brk - tail);
+    }
+
+    // The shrunk top is still the wilderness, so no list changes
+    write_header(top, size, false, true, get_prev_mini(top));
+    write_footer(top, size, false);
+
+    a->heap_brk = new_brk;
+    write_header((block_t *)(new_brk - wsize), 0, true, false, size == min_block_size);
+
+    // Everything past the new break reads as zero once more
+    if (cleared && a->heap_clean > new_brk)
+    {
+        a->heap_clean = new_brk;
+    }
+    return released;
+}
+
+/*
+ * trim_arena: releases the pages of every free block in the arena and trims
+ *             its last block down to pad bytes. Returns the bytes released.
+ */
+static size_t trim_arena(arena_t *a, size_t pad)
+{
+    size_t released = trim_top(a, pad);
+    char *top_end = a->heap_brk - wsize;
+
+    for (block_t *block = a->heap_start; block != NULL; block = next_part(a, block))
+    {
+        for (; get_size(block) > 0; block = find_next(block))
+        {
+            // The last block of the heap keeps its pad and was handled above
+            if (!get_alloc(block) && (char *)find_next(block) != top_end)
+            {
+                released += release_block(block, (char *)block, (char *)find_next(block));
+            }
+        }
+    }
+    return released;
+}
+
+// whether the pointer is a slot in the slab region
+static bool is_slab(void *bp)
+{
+    return slab_lo <= (char *)bp && (char *)bp < slab_lo + slab_region_size;
+}
+
+// the header of the slab run that holds the slot
+static slab_t *slab_of(void *bp)
+{
+    return &slab_meta[((char *)bp - slab_lo) / slab_run_size];
+}
+
+// the first slot of the run
+static char *slab_base(slab_t *run)
+{
+    return slab_lo + (run - slab_meta) * slab_run_size;
+}
+
+// unlinks a run from the list whose head is *head
+static void slab_unlink(slab_t **head, slab_t *run)
+{
+    if (run->prev != NULL)
+        run->prev->next = run->next;
+    else
+        *head = run->next;
+    if (run->next != NULL)
+        run->next->prev = run->prev;
+}
+
+// pushes a run onto the front of the list whose head is *head
+static void slab_push(slab_t **head, slab_t *run)
+{
+    run->prev = NULL;
+    run->next = *head;
+    if (*head != NULL)
+        (*head)->prev = run;
+    *head = run;
+}
+
+/*
+ * slab_new_run: gives arena a an empty run of slots of slot_size bytes,
+ *               reusing one of its empty runs or carving a new one from the
+ *               slab region. Returns NULL once the region is used up.
+ */
+static slab_t *slab_new_run(arena_t *a, size_t slot_size)
+{
+    slab_t *run = a->slab_empty;
+
+    if (run != NULL)
+    {
+        slab_unlink(&a->slab_empty, run);
+    }
+    else
+    {
+        // The break only moves if the run fits, so it never passes the end
+        // of the region that mm_footprint and the stats count up to
+        char *slab_end = slab_lo + slab_region_size;
+#ifdef MM_THREADS
+        char *base = __atomic_load_n(&slab_brk, __ATOMIC_RELAXED);
+        do
+        {
+            if (base + slab_run_size > slab_end)
+            {
+                return NULL;
+            }
+        } while (!__atomic_compare_exchange_n(&slab_brk, &base, base + slab_run_size, true,
+                                              __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+#else
+        char *base = slab_brk;
+        if (base + slab_run_size > slab_end)
+        {
+            return NULL;
+        }
+        slab_brk += slab_run_size;
+#endif
+        run = slab_of(base);
+    }
+
+    run->arena = a;
+    run->slot_size = slot_size;
+    run->nslots = slab_run_size / slot_size;
+    run->nfree = run->nslots;
+
+    // Mark the first nslots slots free
+    for (size_t i = 0; i < 4; i++)
+    {
+        size_t bits = (run->nslots > 64 * i) ? run->nslots - 64 * i : 0;
+        run->free_map[i] = (bits >= 64) ? ~(uint64_t)0 : (((uint64_t)1 << bits) - 1);
+    }
+    return run;
+}
+
+/*
+ * slab_malloc: takes the first free slot, by bit scan, of a run of arena a
+ *              whose slots fit size bytes. Returns NULL if no run can be had.
+ *              The caller holds the arena's lock.
+ */
+static void *slab_malloc(arena_t *a, size_t size)
+{
+    size_t slot_size = round_up(size, dsize);
+    size_t cls = slot_size / dsize - 1;
+    slab_t *run = a->slabs[cls];
+
+    if (run == NULL)
+    {
+        run = slab_new_run(a, slot_size);
+        if (run == NULL)
+        {
+            return NULL;
+        }
+        slab_push(&a->slabs[cls], run);
+    }
+
+    size_t i = 0;
+    while (run->free_map[i] == 0)
+    {
+        i++;
+    }
+    size_t bit = __builtin_ctzll(run->free_map[i]);
+    run->free_map[i] &= run->free_map[i] - 1;
+
+    // A full run leaves the list until one of its slots is freed
+    if (--run->nfree == 0)
+    {
+        slab_unlink(&a->slabs[cls], run);
+    }
+
+    return slab_base(run) + (64 * i + bit) * slot_size;
+}
+
+/*
+ * slab_free: returns a slot to its run. A run that was full goes back on
+ *            its class list; a run that becomes empty while its class has
+ *            other runs is moved to the empty list and its page released.
+ *            The caller holds the lock of the run's arena.
+ */
+static void slab_free(slab_t *run, void *bp)
+{
+    arena_t *a = run->arena;
+    size_t cls = run->slot_size / dsize - 1;
+    size_t idx = ((char *)bp - slab_base(run)) / run->slot_size;
+
+    run->free_map[idx / 64] |= (uint64_t)1 << (idx % 64);
+
+    if (run->nfree++ == 0)
+    {
+        slab_push(&a->slabs[cls], run);
+    }
+    else if (run->nfree == run->nslots && (run->prev != NULL || run->next != NULL))
+    {
+        slab_unlink(&a->slabs[cls], run);
+        slab_push(&a->slab_empty, run);
+        release_pages(slab_base(run), slab_base(run) + slab_run_size);
+    }
+}
+
+/*
+ * handle_new: returns an unused handle, reusing a freed one if there is
+ *             one, or NULL if the handle region is used up.
+ */
+static handle_t *handle_new(void)
+{
+    handle_t *h = NULL;
+
+#ifdef MM_THREADS
+    pthread_mutex_lock(&handle_lock);
+#endif
+    if (handle_free != NULL)
+    {
+        h = handle_free;
+        handle_free = h->ptr;
+    }
+    else if (handle_lo != NULL && handle_brk + sizeof(handle_t) <= handle_lo + handle_region_size)
+    {
+        h = (handle_t *)handle_brk;
+        __atomic_store_n(&handle_brk, handle_brk + sizeof(handle_t), __ATOMIC_RELAXED);
+    }
+#ifdef MM_THREADS
+    pthread_mutex_unlock(&handle_lock);
+#endif
+    return h;
+}
+
+/*
+ * handle_release: puts a handle whose block is gone on the list of freed
+ *                 handles.
+ */
+static void handle_release(handle_t *h)
+{
+#ifdef MM_THREADS
+    pthread_mutex_lock(&handle_lock);
+#endif
+    __atomic_store_n(&h->ptr, (void *)handle_free, __ATOMIC_RELAXED);
+    h->locks = 0;
+    handle_free = h;
+#ifdef MM_THREADS
+    pthread_mutex_unlock(&handle_lock);
+#endif
+}
 
 /*
- * extend_heap: Extends the heap with the requested number of bytes, and
- *              recreates epilogue header. Returns a pointer to the result of
- *              coalescing the newly-created block with previous free block, if
- *              applicable, or NULL in failure.
+ * is_movable: returns true if the allocated block belongs to a handle that
+ *             is not locked. Its first word must point at a handle that
+ *             points right back at it, which no other block can arrange.
  */
-static block_t *extend_heap(size_t size)
+static bool is_movable(block_t *block)
 {
-    void *bp;
-    bool old_alloc = get_alloc_of_prev((block_t *)((char *)mem_heap_hi() - 7));
+    void *bp = header_to_payload(block);
+    handle_t *h = *(handle_t **)bp;
 
-    // Allocate an even number of words to maintain alignment
-    size = round_up(size, dsize);
-    if ((bp = mem_sbrk(size)) == (void *)-1)
+    if ((char *)h < handle_lo || (char *)h >= __atomic_load_n(&handle_brk, __ATOMIC_RELAXED) ||
+        ((char *)h - handle_lo) % sizeof(handle_t) != 0)
+    {
+        return false;
+    }
+    return h->ptr == bp && h->locks == 0;
+}
+
+/*
+ * slide_down: moves the movable block, which follows a free block, to the
+ *             start of that free block and updates its handle. The free
+ *             space ends up after the block, coalesced with whatever free
+ *             block follows. Returns the block at its new place.
+ */
+static block_t *slide_down(arena_t *a, block_t *block)
+{
+    block_t *hole = find_prev(block);
+    size_t hole_size = get_size(hole);
+    size_t size = get_size(block);
+    handle_t *h = *(handle_t **)header_to_payload(block);
+
+    list_remove(a, hole);
+    merged(a, block, hole);
+
+    // The two may overlap; the hole keeps its own prev bits
+    memmove(header_to_payload(hole), header_to_payload(block), size - wsize);
+    write_header(hole, size, true, get_alloc_of_prev(hole), get_prev_mini(hole));
+    __atomic_store_n(&h->ptr, header_to_payload(hole), __ATOMIC_RELAXED);
+
+    block_t *rest = find_next(hole);
+    write_header(rest, hole_size, false, true, size == min_block_size);
+    write_footer(rest, hole_size, false);
+    coalesce(a, rest);
+    return hole;
+}
+
+/*
+ * compact_arena: slides the arena's movable blocks down over the free
+ *                blocks before them in one pass over each part of the
+ *                arena, so each block moves at most once. Then trims the
+ *                end of the heap, unmaps each segment left with one free
+ *                block from fence to fence, and releases the pages of the
+ *                free block at the top of each other segment. Returns the
+ *                bytes released. The caller holds the lock.
+ */
+static size_t compact_arena(arena_t *a)
+{
+    size_t released = 0;
+    block_t *part = a->heap_start;
+
+    while (part != NULL)
+    {
+        block_t *block = part;
+        for (; get_size(block) > 0; block = find_next(block))
+        {
+            if (get_alloc(block) && !get_alloc_of_prev(block) && is_movable(block))
+            {
+                block = slide_down(a, block);
+            }
+        }
+
+        // The part's epilogue leads to the next one, so find it first
+        block_t *next = next_part(a, block);
+        if (part == a->heap_start)
+        {
+            released += trim_top(a, 0);
+        }
+        else if (!get_alloc_of_prev(block))
+        {
+            segment_t *seg = segment_of(part);
+            block_t *top = find_prev(block);
+            if (top == seg->start)
+            {
+                released += segment_size;
+                list_remove(a, top);
+                segment_release(a, seg);
+            }
+            else
+            {
+                released += release_block(top, (char *)top, (char *)block);
+            }
+        }
+        part = next;
+    }
+    return released;
+}
+
+/*
+ * region_grow: serves an object of size bytes that does not fit in the
+ *              region's current chunk. A large object gets a chunk of its
+ *              own, which leaves the current chunk in use; otherwise a new
+ *              chunk, twice as large as the last, takes over. Either way
+ *              the new chunk goes to the front of the list. Returns the
+ *              object, or NULL if malloc fails.
+ */
+static void *region_grow(region_t *r, size_t size)
+{
+    if (size > r->next_size / 4)
+    {
+        if (size > SIZE_MAX - sizeof(region_chunk_t))
+        {
+            return NULL;
+        }
+        region_chunk_t *own = malloc(sizeof(region_chunk_t) + size);
+        if (own == NULL)
+        {
+            return NULL;
+        }
+        own->next = r->chunks;
+        r->chunks = own;
+        return own + 1;
+    }
+
+    region_chunk_t *chunk = malloc(r->next_size);
+    if (chunk == NULL)
     {
         return NULL;
     }
+    chunk->next = r->chunks;
+    r->chunks = chunk;
+    r->cur = (char *)(chunk + 1) + size;
+    r->end = (char *)chunk + r->next_size;
+    r->next_size = min(2 * r->next_size, region_chunk_max);
+    return chunk + 1;
+}
 
-    // Initialize free block header/footer
-    block_t *block = payload_to_header(bp);
-    write_header(block, size, false, old_alloc);
-    write_footer(block, size, false);
+// Function to add a block to its size class list, where the insertion
+// policy puts it; the last block of the heap (not of a segment) becomes the
+// wilderness instead. The block after it must already be in place.
+static void add(arena_t *a, block_t *block)
+{
+    if ((char *)find_next(block) == a->heap_brk - wsize)
+    {
+        a->wild = block;
+        return;
+    }
 
-    // Create new epilogue header
-    block_t *block_next = find_next(block);
-    write_header(block_next, 0, true, false);
+    size_t cls = size_class(get_size(block));
+    block_t *head = a->seg_lists[cls];
 
-    // Coalesce in case the previous block was free
-    return coalesce(block);
+    if (cls == tree_class)
+    {
+        tree_insert(a, block);
+        a->seg_bitmap |= (uint64_t)1 << cls;
+        return;
+    }
+
+    // Find the block to insert it after: none for LIFO, the last one for
+    // FIFO, and the last one below it in the heap for address order
+    block_t *after = NULL;
+    if (policy.insert == MM_INSERT_FIFO)
+        after = a->seg_tails[cls];
+    else if (policy.insert == MM_INSERT_ADDRESS)
+        for (block_t *b = head; b != NULL && b < block; b = link_to_block(a, b->next))
+            after = b;
+
+    block_t *next = (after != NULL) ? link_to_block(a, after->next) : head;
+    block->prev = block_to_link(a, after);
+    block->next = block_to_link(a, next);
+    if (after != NULL)
+        after->next = block_to_link(a, block);
+    else
+        a->seg_lists[cls] = block;
+    if (next != NULL)
+        next->prev = block_to_link(a, block);
+    else
+        a->seg_tails[cls] = block;
+
+    if (cls >= seg_exact_count && policy_indexed())
+        fit_index_add(a, cls - seg_exact_count, block);
+
+    // The class is now known to be nonempty
+    a->seg_bitmap |= (uint64_t)1 << cls;
 }
 
-/* Coalesce: Coalesces current block with previous and next blocks if
- *           either or both are unallocated; otherwise the block is not
- *           modified. Then, insert coalesced block into the segregated list.
- *           Returns pointer to the coalesced block. After coalescing, the
- *           immediate contiguous previous and next blocks must be allocated.
+// Function to remove a block from its size class list, or to take it
+// away as the wilderness
+static void list_remove(arena_t *a, block_t *block)
+{
+    if (block == a->wild)
+    {
+        a->wild = NULL;
+        return;
+    }
+
+    size_t cls = size_class(get_size(block));
+    if (cls == tree_class)
+    {
+        tree_remove(a, block);
+        if (a->seg_lists[cls] == NULL)
+            a->seg_bitmap &= ~((uint64_t)1 << cls);
+        return;
+    }
+
+    block_t *prev = link_to_block(a, block->prev);
+    block_t *next = link_to_block(a, block->next);
+
+    if (prev != NULL)
+        prev->next = block->next;
+    else
+        a->seg_lists[cls] = next; // block was the head of its list
+
+    if (next != NULL)
+        next->prev = block->prev;
+    else
+        a->seg_tails[cls] = prev;
+
+    if (cls >= seg_exact_count)
+    {
+        size_t range = cls - seg_exact_count;
+        if (policy_indexed())
+            fit_index_remove(a, range, block);
+        // Next fit resumes after a block it picked, now being taken
+        if (a->fit_rover[range] == block_to_link(a, block))
+            a->fit_rover[range] = block->next;
+    }
+
+    // Clear the class bit once its list runs empty
+    if (a->seg_lists[cls] == NULL)
+        a->seg_bitmap &= ~((uint64_t)1 << cls);
+}
+
+/*
+ * fit_index_add: enters block, just filed in range class range, in the
+ *                class's index if there is room for it.
  */
-static block_t *coalesce(block_t *block)
+static void fit_index_add(arena_t *a, size_t range, block_t *block)
 {
-    block_t *block_next = find_next(block);
+    uint32_t i = a->fit_count[range];
+    if (i == FIT_INDEX_CAP)
+    {
+        block->left = fit_unindexed;
+        a->fit_spill[range]++;
+        return;
+    }
 
-    bool prev_alloc = get_alloc_of_prev(block);
-    bool next_alloc = get_alloc(block_next);
-    size_t size = get_size(block);
+    a->fit_sizes[range][i] = (uint16_t)get_size(block);
+    a->fit_links[range][i] = block_to_link(a, block);
+    block->left = i;
+    a->fit_count[range] = i + 1;
+}
 
-    // case 1: both previous and next blocks are allocated
-    if (prev_alloc && next_alloc)
+/*
+ * fit_index_remove: takes block out of its class's index, moving the last
+ *                   entry into its slot so that the entries stay packed.
+ */
+static void fit_index_remove(arena_t *a, size_t range, block_t *block)
+{
+    uint32_t i = block->left;
+    if (i == fit_unindexed)
     {
-        write_header(block, size, false, get_alloc_of_prev(block));
-        write_footer(block, size, false);
-        prev_make(block_next, false);
-        add(block); // add current block to free list
-        return block;
+        a->fit_spill[range]--;
+        return;
     }
 
-    // case 2: previous block is allocated, next block is free
-    else if (prev_alloc && !next_alloc)
+    uint32_t last = --a->fit_count[range];
+    if (i != last)
     {
-        size += get_size(block_next); // increase size to include next block
-        write_header(block, size, false, true);
-        write_footer(block, size, false);
-        list_remove(block_next); // remove next block from free list
-        add(block);              // add the merged block to free list
+        a->fit_sizes[range][i] = a->fit_sizes[range][last];
+        a->fit_links[range][i] = a->fit_links[range][last];
+        link_to_block(a, a->fit_links[range][i])->left = i;
     }
+    a->fit_sizes[range][last] = 0;
+}
 
-    // case 3: previous block is free, next block is allocated
-    else if (!prev_alloc && next_alloc)
+/*
+ * fit_index_refill: enters the blocks of range class range that were left
+ *                   out of its index while it was full, for as long as it
+ *                   has room for them, so that find_fit no longer has to
+ *                   scan the list for them.
+ */
+static void fit_index_refill(arena_t *a, size_t range)
+{
+    for (block_t *block = a->seg_lists[seg_exact_count + range];
+         block != NULL && a->fit_spill[range] != 0 && a->fit_count[range] < FIT_INDEX_CAP;
+         block = link_to_block(a, block->next))
     {
-        block_t *block_prev = find_prev(block);
-        size += get_size(block_prev); // increase size to include previous block
-        write_header(block_prev, size, false, true);
-        write_footer(block_prev, size, false);
-        block = block_prev;      // update current block to previous block
-        list_remove(block_prev); // remove previous block from free list
-        prev_make(block_next, false);
-        add(block); // add the merged block to free list
+        if (block->left == fit_unindexed)
+        {
+            a->fit_spill[range]--;
+            fit_index_add(a, range, block);
+        }
     }
+}
 
-    // case 4: both previous and next blocks are free
+/*
+ * fit_index_search: returns the best fit for asize among the blocks in
+ *                   the index of range class range, the one lowest in the
+ *                   heap among equals, or NULL if none fits. With a slack,
+ *                   the first block no more than slack bytes too large is
+ *                   good enough. Only the index is read, never the heap.
+ */
+static block_t *fit_index_search(arena_t *a, size_t range, size_t asize, size_t slack)
+{
+    const uint16_t *sizes = a->fit_sizes[range];
+    const uint32_t *links = a->fit_links[range];
+    uint32_t count = a->fit_count[range];
+
+    // size - asize, as a 16-bit unsigned number, is least for the best fit:
+    // sizes below asize, and the zeros past the last entry, wrap around to
+    // above 0xf000, since no range class size exceeds seg_range_max
+    uint16_t best;
+    uint32_t at = UINT32_MAX;
+#ifdef __SSE2__
+    // Subtract asize from 8 sizes at a time. There is no unsigned 16-bit
+    // minimum in SSE2, so flip the top bit and take the signed one.
+    const __m128i want = _mm_set1_epi16((short)asize);
+    const __m128i flip = _mm_set1_epi16((short)0x8000);
+    const __m128i enough = _mm_set1_epi16((short)(min(slack, 0x7fff) ^ 0x8000));
+    __m128i least = _mm_set1_epi16(0x7fff);
+    for (uint32_t i = 0; i < count; i += 8)
+    {
+        __m128i diff = _mm_sub_epi16(_mm_loadu_si128((const __m128i *)(sizes + i)), want);
+        diff = _mm_xor_si128(diff, flip);
+        if (slack != 0)
+        {
+            int good = _mm_movemask_epi8(_mm_cmpgt_epi16(diff, enough)) ^ 0xffff;
+            if (good != 0)
+                return link_to_block(a, links[i + __builtin_ctz(good) / 2]);
+        }
+        least = _mm_min_epi16(least, diff);
+    }
+
+    // Fold the 8 lanes down to the least
+    least = _mm_min_epi16(least, _mm_shuffle_epi32(least, 0x4e));
+    least = _mm_min_epi16(least, _mm_shuffle_epi32(least, 0xb1));
+    least = _mm_min_epi16(least, _mm_srli_epi32(least, 16));
+    best = (uint16_t)_mm_cvtsi128_si32(least) ^ 0x8000;
+    if (best >= 0x8000)
+    {
+        return NULL;
+    }
+
+    // Then pick the lowest block of that size from the lanes that have it
+    const __m128i target = _mm_set1_epi16((short)(best + asize));
+    for (uint32_t i = 0; i < count; i += 8)
+    {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(sizes + i));
+        // Each lane sets two bits of the mask; keep one of them
+        unsigned hits = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi16(chunk, target)) & 0x5555;
+        for (; hits != 0; hits &= hits - 1)
+        {
+            uint32_t j = i + __builtin_ctz(hits) / 2;
+            if (at == UINT32_MAX || links[j] < links[at])
+                at = j;
+        }
+    }
+#else
+    best = UINT16_MAX;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint16_t diff = (uint16_t)(sizes[i] - asize);
+        if (slack != 0 && diff <= slack)
+            return link_to_block(a, links[i]);
+        if (diff < best || (diff == best && links[i] < links[at]))
+        {
+            best = diff;
+            at = i;
+        }
+    }
+    if (best >= 0x8000)
+    {
+        return NULL;
+    }
+#endif
+
+    return link_to_block(a, links[at]);
+}
+
+/*
+ * tree_replace: puts block, which may be NULL, where old hangs in the size
+ *               tree, under old's parent or as the root.
+ */
+static void tree_replace(arena_t *a, block_t *old, block_t *block)
+{
+    block_t *parent = link_to_block(a, old->parent);
+    uint32_t link = block_to_link(a, block);
+
+    if (parent == NULL)
+        a->seg_lists[tree_class] = block;
+    else if (parent->left == block_to_link(a, old))
+        parent->left = link;
+    else
+        parent->right = link;
+
+    if (block != NULL)
+        block->parent = old->parent;
+}
+
+/*
+ * tree_rotate: rotates the size tree around block, to the left (its right
+ *              child takes its place) or to the right.
+ */
+static void tree_rotate(arena_t *a, block_t *block, bool left)
+{
+    block_t *child = link_to_block(a, left ? block->right : block->left);
+    uint32_t inner = left ? child->left : child->right;
+
+    // The child's inner subtree moves across to block
+    if (left)
+        block->right = inner;
+    else
+        block->left = inner;
+    if (inner != 0)
+        link_to_block(a, inner)->parent = block_to_link(a, block);
+
+    tree_replace(a, block, child);
+    if (left)
+        child->left = block_to_link(a, block);
+    else
+        child->right = block_to_link(a, block);
+    block->parent = block_to_link(a, child);
+}
+
+/*
+ * tree_insert: files a free block in the size tree. A block whose size is
+ *              already in the tree joins the front of that node's list of
+ *              equal-size blocks; otherwise it becomes a new red node and
+ *              the tree is rebalanced.
+ */
+static void tree_insert(arena_t *a, block_t *block)
+{
+    size_t size = get_size(block);
+    block_t *parent = NULL;
+    block_t *node = a->seg_lists[tree_class];
+
+    while (node != NULL)
+    {
+        size_t node_size = get_size(node);
+        if (size == node_size)
+        {
+            block_t *first = link_to_block(a, node->next);
+            block->color = tree_dup;
+            block->prev = block_to_link(a, node);
+            block->next = node->next;
+            if (first != NULL)
+                first->prev = block_to_link(a, block);
+            node->next = block_to_link(a, block);
+            return;
+        }
+        parent = node;
+        node = link_to_block(a, (size < node_size) ? node->left : node->right);
+    }
+
+    block->prev = 0;
+    block->next = 0;
+    block->left = 0;
+    block->right = 0;
+    block->parent = block_to_link(a, parent);
+    block->color = tree_red;
+    if (parent == NULL)
+        a->seg_lists[tree_class] = block;
+    else if (size < get_size(parent))
+        parent->left = block_to_link(a, block);
     else
+        parent->right = block_to_link(a, block);
+
+    // Fix a red node under a red parent, moving up the tree
+    while ((parent = link_to_block(a, block->parent)) != NULL && parent->color == tree_red)
     {
-        block_t *block_prev = find_prev(block);
-        size += get_size(block_next) + get_size(block_prev); // combine sizes of prev, current, and next blocks
-        write_header(block_prev, size, false, true);
-        write_footer(block_prev, size, false);
-        block = block_prev;      // update current block to previous block
-        list_remove(block_prev); // remove previous block from free list
-        list_remove(block_next); // remove next block from free list
-        add(block);              // add the merged large block to free list
+        // A red parent is never the root, so the grandparent exists
+        block_t *grand = link_to_block(a, parent->parent);
+        bool left = link_to_block(a, grand->left) == parent;
+        block_t *uncle = link_to_block(a, left ? grand->right : grand->left);
+
+        if (uncle != NULL && uncle->color == tree_red)
+        {
+            // Push the grandparent's black down a level and retry above
+            parent->color = tree_black;
+            uncle->color = tree_black;
+            grand->color = tree_red;
+            block = grand;
+            continue;
+        }
+
+        // Turn an inner grandchild into an outer one
+        if (block == link_to_block(a, left ? parent->right : parent->left))
+        {
+            block = parent;
+            tree_rotate(a, block, left);
+            parent = link_to_block(a, block->parent);
+        }
+        parent->color = tree_black;
+        grand->color = tree_red;
+        tree_rotate(a, grand, !left);
     }
-    return block; // return the coalesced block
+    a->seg_lists[tree_class]->color = tree_black;
 }
 
 /*
- * place: Places block with size of asize at the start of bp. If the remaining
- *        size is at least the minimum block size, then split the block to the
- *        the allocated block and the remaining block as free, which is then
- *        inserted into the segregated list. Requires that the block is
- *        initially unallocated.
+ * tree_remove: takes a free block out of the size tree. A block from an
+ *              equal-size list is simply unlinked, and a node with such a
+ *              list hands its place to the first block on it; only the last
+ *              block of its size is deleted from the tree itself.
  */
-static void place(block_t *block, size_t asize)
+static void tree_remove(arena_t *a, block_t *block)
 {
-    size_t csize = get_size(block);
+    block_t *next = link_to_block(a, block->next);
 
-    // Check if the remaining space after allocation is large enough to form a new block
-    if ((csize - asize) >= min_block_size)
+    if (block->color == tree_dup)
     {
-        block_t *block_next;
+        // The previous block is the node or another equal-size block
+        link_to_block(a, block->prev)->next = block->next;
+        if (next != NULL)
+            next->prev = block->prev;
+        return;
+    }
 
-        // Mark the current block as allocated
-        write_header(block, asize, true, true);
+    if (next != NULL)
+    {
+        next->prev = 0;
+        next->left = block->left;
+        next->right = block->right;
+        next->color = block->color;
+        tree_replace(a, block, next);
+        if (next->left != 0)
+            link_to_block(a, next->left)->parent = block_to_link(a, next);
+        if (next->right != 0)
+            link_to_block(a, next->right)->parent = block_to_link(a, next);
+        return;
+    }
 
-        // Find and prepare the next block as a new free block
-        block_next = find_next(block);
-        write_header(block_next, csize - asize, false, true);
-        write_footer(block_next, csize - asize, false);
+    // Unlink the node, or its successor in its place if it has two children
+    block_t *left = link_to_block(a, block->left);
+    block_t *right = link_to_block(a, block->right);
+    block_t *child;
+    block_t *parent;
+    uint32_t color;
 
-        // Add the new free block to the free list
-        add(block_next);
+    if (left == NULL || right == NULL)
+    {
+        child = (left != NULL) ? left : right;
+        parent = link_to_block(a, block->parent);
+        color = block->color;
+        tree_replace(a, block, child);
     }
     else
     {
-        // If the remaining space is not large enough, allocate the entire block
-        write_header(block, csize, true, true);
+        block_t *succ = right;
+        while (succ->left != 0)
+            succ = link_to_block(a, succ->left);
 
-        // Update the allocation status of the next block
-        prev_make(find_next(block), true);
+        child = link_to_block(a, succ->right);
+        color = succ->color;
+        if (succ == right)
+        {
+            parent = succ;
+        }
+        else
+        {
+            parent = link_to_block(a, succ->parent);
+            tree_replace(a, succ, child);
+            succ->right = block->right;
+            right->parent = block_to_link(a, succ);
+        }
+        tree_replace(a, block, succ);
+        succ->left = block->left;
+        left->parent = block_to_link(a, succ);
+        succ->color = block->color;
+    }
+
+    if (color == tree_red)
+    {
+        return;
+    }
+
+    // A black node went away: child is short of one black on its paths
+    while (child != a->seg_lists[tree_class] && (child == NULL || child->color == tree_black))
+    {
+        bool is_left = link_to_block(a, parent->left) == child;
+        block_t *sibling = link_to_block(a, is_left ? parent->right : parent->left);
+
+        if (sibling->color == tree_red)
+        {
+            sibling->color = tree_black;
+            parent->color = tree_red;
+            tree_rotate(a, parent, is_left);
+            sibling = link_to_block(a, is_left ? parent->right : parent->left);
+        }
+
+        block_t *near = link_to_block(a, is_left ? sibling->left : sibling->right);
+        block_t *far = link_to_block(a, is_left ? sibling->right : sibling->left);
+        bool near_black = (near == NULL || near->color == tree_black);
+        bool far_black = (far == NULL || far->color == tree_black);
+
+        if (near_black && far_black)
+        {
+            // Take a black off the sibling's side and retry one level up
+            sibling->color = tree_red;
+            child = parent;
+            parent = link_to_block(a, child->parent);
+            continue;
+        }
+
+        if (far_black)
+        {
+            near->color = tree_black;
+            sibling->color = tree_red;
+            tree_rotate(a, sibling, !is_left);
+            sibling = link_to_block(a, is_left ? parent->right : parent->left);
+            far = link_to_block(a, is_left ? sibling->right : sibling->left);
+        }
+        sibling->color = parent->color;
+        parent->color = tree_black;
+        far->color = tree_black;
+        tree_rotate(a, parent, is_left);
+        child = a->seg_lists[tree_class];
+    }
+    if (child != NULL)
+        child->color = tree_black;
+}
+
+/*
+ * tree_best_fit: returns the smallest block in the size tree of at least
+ *                asize bytes, or NULL if there is none. A block from the
+ *                node's equal-size list is preferred, since removing it
+ *                leaves the tree unchanged.
+ */
+static block_t *tree_best_fit(arena_t *a, size_t asize)
+{
+    block_t *best = NULL;
+    block_t *node = a->seg_lists[tree_class];
+    size_t visited = 0;
+
+    while (node != NULL)
+    {
+        size_t size = get_size(node);
+        visited++;
+        if (size == asize)
+        {
+            best = node;
+            break;
+        }
+        if (size > asize)
+        {
+            best = node;
+            node = link_to_block(a, node->left);
+        }
+        else
+        {
+            node = link_to_block(a, node->right);
+        }
     }
 
-    // Remove the current block from the free list, as it's now allocated
-    list_remove(block);
+    stat_hist(stats.fit_scan, visited);
+    if (best != NULL && best->next != 0)
+    {
+        return link_to_block(a, best->next);
+    }
+    return best;
 }
 
-// Function to add a block to the free list
-static void add(block_t *block)
+/*
+ * find_fit:
+ * Searches the segregated lists for a block of at least 'asize' bytes.
+ * An exact class holds only blocks of exactly asize, so its head is a
+ * perfect fit. A range class is searched as the fit policy says: its
+ * index for the best or a good fit among the blocks it holds (and, if some
+ * were left out of it, the start of the list as well), or its list for the
+ * first, next, or bounded best fit. The tree is searched for the best fit
+ * of all.
+ * Failing that, every block in any higher nonempty class is large enough,
+ * so the head of the first one found through the bitmap is returned, or
+ * the smallest block if that class is the tree.
+ * Returns a pointer to the block if found, otherwise NULL.
+ */
+static block_t *find_fit(arena_t *a, size_t asize)
 {
-    // Check if the block to be added is not the root itself
-    // This prevents creating a cycle in the list if the root is passed in
-    if (block != root)
+    size_t cls = size_class(asize);
+
+    if (cls == tree_class)
     {
-        // Set the new block's next pointer to the current root
-        // This inserts the block before the first element of the list
-        block->next = root;
+        return tree_best_fit(a, asize);
+    }
 
-        // If the list is not empty (root is not NULL),
-        // set the current root's previous pointer to the new block
-        if (root != NULL)
-            root->prev = block;
+    if (cls < seg_exact_count)
+    {
+        if (a->seg_lists[cls] != NULL)
+        {
+            stat_hist(stats.fit_scan, 1);
+            return a->seg_lists[cls];
+        }
+    }
+    else
+    {
+        size_t range = cls - seg_exact_count;
+        block_t *head = a->seg_lists[cls];
+        block_t *fit = NULL;
+        unsigned checked = 0;
 
-        // Move the root pointer to point to the new block,
-        // effectively making it the first block in the list
-        root = block;
+        switch (policy.fit)
+        {
+        case MM_FIT_BEST:
+        case MM_FIT_GOOD:
+            // The index gives the best (or a good) fit among all the blocks
+            // it holds, with the one block it leads to the only one read.
+            // Blocks left out of it when it was full are only on the list;
+            // scan the start of the list for those
+            fit = fit_index_search(a, range, asize,
+                                   (policy.fit == MM_FIT_GOOD) ? asize >> policy.good_shift : 0);
+            checked = 1;
+            if (fit == NULL && a->fit_spill[range] != 0)
+                fit = list_scan(a, head, NULL, asize, false, policy.fit_bound, &checked);
+            break;
+        case MM_FIT_FIRST:
+            fit = list_scan(a, head, NULL, asize, true, UINT_MAX, &checked);
+            break;
+        case MM_FIT_NEXT:
+        {
+            // Resume at the rover, wrapping around to the head
+            block_t *rover = (a->fit_rover[range] != 0) ? link_to_block(a, a->fit_rover[range]) : head;
+            fit = list_scan(a, rover, NULL, asize, true, UINT_MAX, &checked);
+            if (fit == NULL && rover != head)
+                fit = list_scan(a, head, rover, asize, true, UINT_MAX, &checked);
+            a->fit_rover[range] = block_to_link(a, fit);
+            break;
+        }
+        case MM_FIT_BOUNDED:
+            fit = list_scan(a, head, NULL, asize, false, policy.fit_bound, &checked);
+            break;
+        }
 
-        // Since the new block is now at the beginning,
-        // set its previous pointer to NULL
-        root->prev = NULL;
+        stat_hist(stats.fit_scan, checked);
+        if (fit != NULL)
+        {
+            return fit;
+        }
     }
-}
 
-// Function to remove a block from the free list
-static void list_remove(block_t *block)
-{
-    // if block and root are the same
-    if (block == root)
+    // Every block in a higher class fits; take the first nonempty one
+    uint64_t larger = a->seg_bitmap & ~(((uint64_t)2 << cls) - 1);
+    if (larger == 0)
     {
-        root = root->next;
-        if (root != NULL && root->prev != NULL)
-            root->prev = NULL;
+        return NULL;
     }
-    else
+    size_t next_cls = __builtin_ctzll(larger);
+    if (next_cls == tree_class)
     {
-        // Update the prev pointer of the next free block
-        block->prev->next = block->next;
-        // Update the next pointer of the previous free block
-        if (block->next != NULL)
-            block->next->prev = block->prev;
-        return;
+        return tree_best_fit(a, asize);
     }
+    return a->seg_lists[next_cls];
 }
 
 /*
- * find_fit:
- * Searches for the best_fit_block-fitting block within the free list.
- * Implements a best_fit_block-fit policy to find a block of
- * at least 'asize' bytes.
- * Returns a pointer to the block if found, otherwise NULL.
+ * list_scan: looks at up to bound blocks of a range class list, from from
+ *            up to but not including stop (NULL for the end of the list).
+ *            Returns the first block that fits asize if first is set, and
+ *            otherwise the best fit among them, or NULL if none fits; adds
+ *            the number of blocks looked at to *checked. Blocks that the
+ *            index left out are entered into it as they are passed, once
+ *            it has room for them again.
  */
-static block_t *find_fit(size_t asize)
+static block_t *list_scan(arena_t *a, block_t *from, block_t *stop, size_t asize,
+                          bool first, unsigned bound, unsigned *checked)
 {
     block_t *best_fit_block = NULL;
-    block_t *block = root;
     size_t size_fit = (size_t)-1;
-    int num_checked = 200;
 
-    while (block != NULL && num_checked > 0)
+    for (block_t *block = from; block != stop && bound > 0;
+         block = link_to_block(a, block->next), bound--)
     {
         size_t blockSize = get_size(block);
+        (*checked)++;
+
+        if (policy_indexed() && block->left == fit_unindexed)
+        {
+            size_t range = size_class(blockSize) - seg_exact_count;
+            if (a->fit_count[range] < FIT_INDEX_CAP)
+            {
+                a->fit_spill[range]--;
+                fit_index_add(a, range, block);
+            }
+        }
 
-        // Check for a perfect fit
-        if (blockSize == asize)
+        // Check for a perfect fit, or any fit if the first will do
+        if (blockSize == asize || (first && blockSize > asize))
         {
             return block;
         }
 
         // If this block is a better fit, update best_fit_block and size_fit
-        if (asize <= blockSize)
+        if (asize <= blockSize && blockSize < size_fit)
         {
-            if (blockSize < size_fit)
-            {
-                size_fit = blockSize;
-                best_fit_block = block;
-            }
+            size_fit = blockSize;
+            best_fit_block = block;
+        }
+    }
+    return best_fit_block;
+}
+
+/*
+ * policy_indexed: whether the fit policy uses the packed index, and so
+ *                 whether add and list_remove keep it.
+ */
+static bool policy_indexed(void)
+{
+    return policy.fit == MM_FIT_BEST || policy.fit == MM_FIT_GOOD;
+}
+
+/*
+ * wild_fit: returns a free block of at least asize bytes at the end of the
+ *           heap, for when find_fit finds nothing. That is the wilderness
+ *           if it is large enough. Otherwise the heap grows by what the
+ *           wilderness lacks, but by no less than the arena's chunk, which
+ *           doubles with every growth up to grow_max so that a growing heap
+ *           asks for memory less and less often; the chunk is held to an
+ *           eighth of the heap so that small heaps are not padded out.
+ *           If the heap cannot grow even by the shortfall, the block comes
+ *           from a new segment instead. Returns NULL if none can be had.
+ *           Pending frees are merged first, and may make room anywhere.
+ */
+static block_t *wild_fit(arena_t *a, size_t asize)
+{
+    if (pending_merge(a, SIZE_MAX) > 0)
+    {
+        block_t *fit = find_fit(a, asize);
+        if (fit != NULL)
+        {
+            return fit;
         }
+    }
 
-        block = block->next; // Move to the next block
-        num_checked--;       // Decrement the num_checked
+    size_t have = (a->wild != NULL) ? get_size(a->wild) : 0;
+    if (have >= asize)
+    {
+        return a->wild;
     }
 
-    return best_fit_block;
-    // Return the best_fit_block fitting block or
-    // NULL if no fitting block was found
+    // A small heap grows by no more than an eighth of its size at a time
+    size_t shortfall = asize - have;
+    size_t chunk = max(policy.grow_min, round_up((a->heap_brk - a->heap_lo) / 8, dsize));
+    if (chunk > a->chunk)
+    {
+        chunk = a->chunk;
+    }
+    block_t *block = extend_heap(a, max(shortfall, chunk));
+    if (block == NULL && shortfall < chunk)
+    {
+        block = extend_heap(a, shortfall);
+    }
+    if (block == NULL)
+    {
+        // The heap cannot grow at all, so the request gets a new segment
+        return segment_add(a, asize);
+    }
+    if (a->chunk < policy.grow_max)
+    {
+        a->chunk = min(2 * a->chunk, policy.grow_max);
+    }
+    return block;
 }
 
 /*
@@ -530,6 +5207,14 @@ static size_t max(size_t x, size_t y)
     return (x > y) ? x : y;
 }
 
+/*
+ * min: returns x if x < y, and y otherwise.
+ */
+static size_t min(size_t x, size_t y)
+{
+    return (x < y) ? x : y;
+}
+
 /*
  * round_up: Rounds size up to next multiple of n
  */
@@ -542,10 +5227,11 @@ static size_t round_up(size_t size, size_t n)
  * pack: returns a header reflecting a specified size and its alloc status.
  *       If the block is allocated, the lowest bit is set to 1, and 0 otherwise.
  *          and theseond lowest bit reflects allocation status of previous block
+ *          and the fourth bit is set when the previous block is a mini block
  */
-static word_t pack(size_t size, bool alloc, bool alloc_of_prev)
+static word_t pack(size_t size, bool alloc, bool alloc_of_prev, bool prev_mini)
 {
-    return (size | (alloc ? 1 : 0) | (alloc_of_prev ? 2 : 0));
+    return (size | (alloc ? 1 : 0) | (alloc_of_prev ? 2 : 0) | (prev_mini ? prev_mini_bit : 0));
 }
 
 /*
@@ -574,6 +5260,11 @@ static size_t get_size(block_t *block)
 static word_t get_payload_size(block_t *block)
 {
     size_t asize = get_size(block);
+    // A mapped block's size also counts the mapping's leading words
+    if (get_mapped(block))
+    {
+        return asize - *find_prev_footer(block) - wsize;
+    }
     return asize - wsize;
 }
 
@@ -596,23 +5287,29 @@ static bool get_alloc(block_t *block)
 }
 
 /*
- * write_header: given a block and its size and allocation status,
- *               writes an appropriate value to the block header.
+ * write_header: given a block and its size and allocation status, and those
+ *               of the block before it, writes an appropriate value to the
+ *               block header.
  */
-static void write_header(block_t *block, size_t size, bool alloc, bool alloc_of_prev)
+static void write_header(block_t *block, size_t size, bool alloc, bool alloc_of_prev, bool prev_mini)
 {
-    block->header = pack(size, alloc, alloc_of_prev);
+    block->header = pack(size, alloc, alloc_of_prev, prev_mini);
 }
 
 /*
  * write_footer: given a block and its size and allocation status,
  *               writes an appropriate value to the block footer by first
- *               computing the position of the footer.
+ *               computing the position of the footer. Mini blocks have no
+ *               footer; their links fill the word it would take.
  */
 static void write_footer(block_t *block, size_t size, bool alloc)
 {
+    if (size == min_block_size)
+    {
+        return;
+    }
     word_t *footerp = (word_t *)((block->payload) + get_size(block) - dsize);
-    *footerp = pack(size, alloc, false);
+    *footerp = pack(size, alloc, false, false);
 }
 
 /*
@@ -636,10 +5333,15 @@ static word_t *find_prev_footer(block_t *block)
 /*
  * find_prev: returns the previous block position by checking the previous
  *            block's footer and calculating the start of the previous block
- *            based on its size.
+ *            based on its size. A mini block has no footer, but then the
+ *            block's prev-mini bit gives its size.
  */
 static block_t *find_prev(block_t *block)
 {
+    if (get_prev_mini(block))
+    {
+        return (block_t *)((char *)block - min_block_size);
+    }
     word_t *footerp = find_prev_footer(block);
     size_t size = extract_size(*footerp);
     return (block_t *)((char *)block - size);
@@ -680,28 +5382,74 @@ bool get_alloc_of_prev(block_t *block)
     return (bool)((block->header) & 0x2);
 }
 
+// setting whether the previous block is a mini block
+static void prev_mini_make(block_t *block, bool mini)
+{
+    if (mini)
+        block->header = block->header | prev_mini_bit;
+    else
+        block->header = block->header & ~prev_mini_bit;
+}
+
+// getting whether the previous block is a mini block
+static bool get_prev_mini(block_t *block)
+{
+    return (bool)((block->header) & prev_mini_bit);
+}
+
+// turns a free-list link of the arena back into a block pointer
+static block_t *link_to_block(arena_t *a, uint32_t link)
+{
+    if (link == 0)
+    {
+        return NULL;
+    }
+    return (block_t *)(a->heap_lo - wsize + ((ptrdiff_t)link - link_bias) * (ptrdiff_t)dsize);
+}
+
+// turns a block pointer, or NULL, into a free-list link of the arena
+static uint32_t block_to_link(arena_t *a, block_t *block)
+{
+    if (block == NULL)
+    {
+        return 0;
+    }
+    return (uint32_t)(((char *)block - (a->heap_lo - wsize)) / (ptrdiff_t)dsize + link_bias);
+}
+
+// whether the block lives in a mapping of its own
+static bool get_mapped(block_t *block)
+{
+    return (bool)((block->header) & mapped_bit);
+}
+
 // Verifies the epilogue and prologue block's size and allocation status.
 bool check_block(block_t *block)
 {
     return extract_size(block->header) == 0 && get_alloc(block) == 1;
 }
 
-// Checks for no consecutive free blocks in the heap.
-bool check_adj_free_blocks(block_t *current_blk)
+// Checks that a free block does not follow another free block, which
+// coalescing should have prevented.
+bool check_adj_free_blocks(block_t *current_blk, bool prev_alloc)
 {
-    bool prev_free = false;
-    while (get_size(current_blk) > 0)
-    {
-        bool curr_alloc = get_alloc(current_blk);
-        if (!curr_alloc && prev_free)
-            return false;
-        prev_free = !curr_alloc;
-        current_blk = find_next(current_blk);
-    }
-    return true;
+    return prev_alloc || get_alloc(current_blk);
 }
 
 
+// Checks that size, and alignment, could be what the allocated block at bp
+// was last requested with: it must fit, in a block that placing a request
+// of size bytes would not have split further.
+bool check_free_size(void *bp, size_t size, size_t align)
+{
+    if ((uintptr_t)bp % align != 0 || size > mm_usable_size(bp))
+        return false;
+    if (is_slab(bp) || get_mapped(payload_to_header(bp)))
+        return true;
+    size_t asize = max(round_up(size + wsize, dsize), min_block_size);
+    return get_size(payload_to_header(bp)) - asize < max(policy.split_min, min_block_size);
+}
+
 // Checks for proper block alignment and minimum block size.
 bool check_alignment_min_size(block_t *current_blk)
 {
@@ -710,71 +5458,518 @@ bool check_alignment_min_size(block_t *current_blk)
     return (blk_address % dsize == 0) && (blk_size >= min_block_size);
 }
 
-// Verifies that the block resides within the boundaries of the heap.
-bool check_within_heap(block_t *current_blk)
+// Checks that a block's prev bits describe the block before it, and that a
+// free block's footer, if it has one, matches its header.
+bool check_boundary_tags(block_t *current_blk, size_t prev_size, bool prev_alloc)
+{
+    if (get_alloc_of_prev(current_blk) != prev_alloc)
+        return false;
+    if (get_prev_mini(current_blk) != (prev_size == min_block_size))
+        return false;
+
+    size_t size = get_size(current_blk);
+    if (size == 0 || get_alloc(current_blk) || size == min_block_size)
+        return true;
+    word_t footer = *(word_t *)(current_blk->payload + size - dsize);
+    return extract_size(footer) == size && (footer & 0x1) == 0;
+}
+
+// Checks that an allocated block lies below the clean mark, and that the
+// part of a free block past it is zero apart from the block's header, links
+// and footer, even if the block starts below the mark; only the first
+// scan_limit bytes of that part are looked at.
+bool check_clean(arena_t *a, block_t *current_blk, size_t scan_limit)
+{
+    size_t size = get_size(current_blk);
+    char *end = (char *)current_blk + size;
+    char *clean = *clean_mark(a, current_blk);
+    if (get_alloc(current_blk))
+        return end <= clean;
+    if (end <= clean)
+        return true;
+
+    char *start = (char *)current_blk + sizeof(block_t);
+    if (start < clean)
+        start = clean;
+    if (end - wsize > start && (size_t)(end - wsize - start) > scan_limit)
+        end = start + scan_limit + wsize;
+    for (word_t *w = (word_t *)start; (char *)w < end - wsize; w++)
+    {
+        if (*w != 0)
+            return false;
+    }
+    return true;
+}
+
+// Checks that the memory an extra arena has given back, from its break up
+// to the highest break it has had, is zero, since the clean mark covers it
+// once the heap grows again; only the first scan_limit bytes are looked at.
+bool check_clean_top(arena_t *a, size_t scan_limit)
+{
+    if (a->heap_end == NULL)
+        return true;
+    char *start = (a->heap_clean > a->heap_brk) ? a->heap_clean : a->heap_brk;
+    char *end = a->heap_top;
+    if (end > start && (size_t)(end - start) > scan_limit)
+        end = start + scan_limit;
+    for (word_t *w = (word_t *)start; (char *)w < end; w++)
+    {
+        if (*w != 0)
+            return false;
+    }
+    return true;
+}
+
+// Verifies that the block resides within the boundaries of the arena's heap
+// or of one of its segments.
+bool check_within_heap(arena_t *a, block_t *current_blk)
+{
+    char *p = (char *)current_blk;
+    if (p < a->heap_brk && a->heap_lo <= p)
+        return true;
+    for (segment_t *seg = a->segments; seg != NULL; seg = seg->next)
+    {
+        if (p >= (char *)seg->start && p < (char *)seg + segment_size)
+            return true;
+    }
+    return false;
+}
+
+// Checks the arena's list of segments: each is aligned, names the arena,
+// links back to the one before it, and starts its blocks after its fences.
+bool check_segments(arena_t *a)
+{
+    segment_t *prev = NULL;
+    for (segment_t *seg = a->segments; seg != NULL; prev = seg, seg = seg->next)
+    {
+        if (segment_of(seg) != seg || seg->arena != a || seg->prev != prev)
+            return false;
+        if ((char *)seg->start != (char *)seg + round_up(sizeof(segment_t), dsize) + wsize)
+            return false;
+    }
+    return true;
+}
+
+// Checks that a free block found by the heap walk is really on the free
+// list or in the tree for its size: its neighbours there must point back to
+// it, and a block with nothing before it must be the head of its list (or
+// the root of the tree). Tree nodes also have their children checked
+// against their size and color, which keeps this local to the block.
+bool check_links(arena_t *a, block_t *current_blk)
+{
+    size_t size = get_size(current_blk);
+    size_t cls = size_class(size);
+    uint32_t self = block_to_link(a, current_blk);
+    block_t *prev = link_to_block(a, current_blk->prev);
+    block_t *next = link_to_block(a, current_blk->next);
+
+    if ((prev && !check_within_heap(a, prev)) || (next && !check_within_heap(a, next)))
+        return false;
+    if (next && next->prev != self)
+        return false;
+
+    // A range class block's slot in the index must lead back to it
+    if (cls >= seg_exact_count && cls != tree_class && policy_indexed() &&
+        current_blk->left != fit_unindexed)
+    {
+        size_t range = cls - seg_exact_count;
+        uint32_t slot = current_blk->left;
+        if (slot >= a->fit_count[range] || a->fit_links[range][slot] != self ||
+            a->fit_sizes[range][slot] != size)
+            return false;
+    }
+
+    // List blocks, and tree blocks chained off a node of their size
+    if (cls != tree_class || current_blk->color == tree_dup)
+        return (prev != NULL) ? prev->next == self : a->seg_lists[cls] == current_blk;
+
+    block_t *parent = link_to_block(a, current_blk->parent);
+    block_t *left = link_to_block(a, current_blk->left);
+    block_t *right = link_to_block(a, current_blk->right);
+    if (prev != NULL || (parent && !check_within_heap(a, parent)) ||
+        (left && !check_within_heap(a, left)) || (right && !check_within_heap(a, right)))
+        return false;
+    if ((parent == NULL) ? a->seg_lists[cls] != current_blk
+                         : parent->left != self && parent->right != self)
+        return false;
+    if (left && (left->parent != self || get_size(left) >= size))
+        return false;
+    if (right && (right->parent != self || get_size(right) <= size))
+        return false;
+    return current_blk->color == tree_black ||
+           ((!left || left->color == tree_black) && (!right || right->color == tree_black));
+}
+
+// Checks the subtree at node, whose sizes must lie in (lo, hi), and its
+// equal-size lists; counts its blocks into *count. Returns the subtree's
+// black height, or -1 if it breaks the ordering or red-black rules.
+int check_tree(arena_t *a, block_t *node, block_t *parent, size_t lo, size_t hi, uint64_t *count)
 {
-    return ((current_blk <= (block_t *)mem_heap_hi() && (block_t *)mem_heap_lo() <= current_blk));
+    if (node == NULL)
+        return 1;
+
+    size_t size = get_size(node);
+    if (!check_within_heap(a, node) || get_alloc(node) || size <= lo || size >= hi ||
+        link_to_block(a, node->parent) != parent || node->prev != 0)
+        return -1;
+    if (node->color != tree_red && node->color != tree_black)
+        return -1;
+
+    // No red node has a red child
+    block_t *left = link_to_block(a, node->left);
+    block_t *right = link_to_block(a, node->right);
+    if (node->color == tree_red &&
+        ((left && left->color == tree_red) || (right && right->color == tree_red)))
+        return -1;
+
+    // Walk the node's list of equal-size blocks
+    (*count)++;
+    for (block_t *prev = node, *dup = link_to_block(a, node->next); dup != NULL;
+         prev = dup, dup = link_to_block(a, dup->next))
+    {
+        if (!check_within_heap(a, dup) || get_alloc(dup) || get_size(dup) != size ||
+            dup->color != tree_dup || link_to_block(a, dup->prev) != prev)
+            return -1;
+        (*count)++;
+    }
+
+    // Both subtrees must have the same black height
+    int left_height = check_tree(a, left, node, lo, size, count);
+    int right_height = check_tree(a, right, node, size, hi, count);
+    if (left_height < 0 || left_height != right_height)
+        return -1;
+    return left_height + (node->color == tree_black);
 }
 
-// Validates the free list's consistency and pointer ranges.
-bool check_free_list(block_t *start_free_blk, uint64_t count_expected)
+// Validates the free lists' consistency, size classes and pointer ranges.
+bool check_free_list(arena_t *a, uint64_t count_expected)
 {
     uint64_t free_list_count = 0;
-    for (block_t *current = start_free_blk; current != NULL; current = current->next)
+    for (size_t cls = 0; cls < SEG_CLASSES; cls++)
     {
-        // Increase free block count
-        free_list_count++;
-        // Check if next and previous blocks are within heap boundaries
-        if ((current->next && !check_within_heap(current->next)) ||
-            (current->prev && !check_within_heap(current->prev)))
+        // The bitmap must agree with whether the list is empty
+        bool nonempty = (a->seg_bitmap >> cls) & 1;
+        if (nonempty != (a->seg_lists[cls] != NULL))
+            return false;
+
+        // The tree holds the largest blocks and has a black root
+        if (cls == tree_class)
+        {
+            block_t *root = a->seg_lists[cls];
+            if (root != NULL && root->color != tree_black)
+                return false;
+            if (check_tree(a, root, NULL, seg_range_max, (size_t)-1, &free_list_count) < 0)
+                return false;
+            continue;
+        }
+
+        uint64_t class_count = 0, unindexed = 0;
+        for (block_t *current = a->seg_lists[cls]; current != NULL;
+             current = link_to_block(a, current->next))
         {
+            block_t *next = link_to_block(a, current->next);
+            block_t *prev = link_to_block(a, current->prev);
+
+            // Increase free block count
+            free_list_count++;
+            class_count++;
+            if (cls >= seg_exact_count && current->left == fit_unindexed)
+                unindexed++;
+            // The last block of the list must be its tail
+            if (next == NULL && a->seg_tails[cls] != current)
+                return false;
+            // Check that the block is free and filed under the right class
+            if (get_alloc(current) || size_class(get_size(current)) != cls)
+                return false;
+            // Check if next and previous blocks are within heap boundaries
+            if ((next && !check_within_heap(a, next)) ||
+                (prev && !check_within_heap(a, prev)))
+            {
+                return false;
+            }
+            // Check that the links agree with each other
+            if (next && link_to_block(a, next->prev) != current)
+                return false;
+        }
+
+        if (a->seg_lists[cls] == NULL && a->seg_tails[cls] != NULL)
             return false;
+
+        // Every block of a range class is in its index or counted out of
+        // it (check_links matches the entries to their blocks), and the
+        // index is zero past its last entry
+        if (cls >= seg_exact_count && policy_indexed())
+        {
+            size_t range = cls - seg_exact_count;
+            if (a->fit_spill[range] != unindexed || a->fit_count[range] != class_count - unindexed)
+                return false;
+            for (size_t i = a->fit_count[range]; i < FIT_INDEX_CAP; i++)
+                if (a->fit_sizes[range][i] != 0)
+                    return false;
         }
     }
     // Check if counted free blocks match the expected number
     return free_list_count == count_expected;
 }
 
-/* mm_checkheap: checks the heap for correctness; returns true if
- *               the heap is correct, and false otherwise.
- *               can call this function using mm_checkheap(__LINE__);
- *               to identify the line number of the call site.
- */
-bool mm_checkheap(int line_number)
+// Checks the arena's slab runs: bitmaps, counts, owners and list links.
+bool check_slabs(arena_t *a)
+{
+    for (size_t cls = 0; cls <= SLAB_CLASSES; cls++)
+    {
+        slab_t *head = (cls < SLAB_CLASSES) ? a->slabs[cls] : a->slab_empty;
+        for (slab_t *run = head; run != NULL; run = run->next)
+        {
+            size_t nfree = 0;
+            for (size_t i = 0; i < 4; i++)
+                nfree += __builtin_popcountll(run->free_map[i]);
+
+            // Listed runs have free slots; empty runs have nothing in use
+            if (nfree != run->nfree || nfree == 0 || run->arena != a)
+                return false;
+            if (cls < SLAB_CLASSES && run->slot_size != (cls + 1) * dsize)
+                return false;
+            if (cls == SLAB_CLASSES && nfree != run->nslots)
+                return false;
+            if (run < slab_meta || !is_slab(slab_base(run)) ||
+                (run->next && run->next->prev != run))
+                return false;
+        }
+    }
+    return true;
+}
+
+// Runs every check on one block of the heap walk, given the size and
+// allocation status of the block before it.
+bool check_heap_block(arena_t *a, block_t *current_blk, size_t prev_size, bool prev_alloc,
+                      size_t scan_limit)
+{
+    // Ensures each block is within the heap bounds
+    if (!check_within_heap(a, current_blk))
+        return false;
+
+    // The prev-alloc and prev-mini bits must match the previous block
+    if (!check_boundary_tags(current_blk, prev_size, prev_alloc))
+        return false;
+
+    // check for proper coalescing
+    if (!check_adj_free_blocks(current_blk, prev_alloc))
+        return false;
+
+    // Checks alignment and minimum size requirements for each block.
+    if (!check_alignment_min_size(current_blk))
+        return false;
+
+    // Memory past the clean mark must read as zero
+    if (!check_clean(a, current_blk, scan_limit))
+        return false;
+
+    // A free block must be where the free lists say it is; the wilderness
+    // is the last block of the heap and on no list
+    if (current_blk == a->wild)
+        return !get_alloc(current_blk) && (char *)find_next(current_blk) == a->heap_brk - wsize;
+    return get_alloc(current_blk) || check_links(a, current_blk);
+}
+
+// Checks the epilogue a walk of one part of the arena's heap has reached,
+// given the block before it, and the prologue of the part that follows.
+bool check_part_end(arena_t *a, block_t *end_blk, size_t prev_size, bool prev_alloc)
+{
+    // Its tags must match too, and a free last block of the heap must be
+    // the wilderness
+    if (!check_block(end_blk) || !check_boundary_tags(end_blk, prev_size, prev_alloc))
+        return false;
+    if ((char *)end_blk == a->heap_brk - wsize && prev_alloc != (a->wild == NULL))
+        return false;
+    block_t *next = next_part(a, end_blk);
+    return next == NULL || check_block((block_t *)((word_t *)next - 1));
+}
+
+// Checks the arena's pending frees: each is an allocated block of the
+// arena, and there are no more of them than allocated blocks, so neither
+// list loops. Frees pushed during the check may go unseen.
+bool check_pending(arena_t *a, uint64_t alloc_count)
+{
+    uint64_t pending_count = 0;
+    block_t *lists[2] = {a->merging, __atomic_load_n(&a->pending, __ATOMIC_ACQUIRE)};
+    for (size_t i = 0; i < 2; i++)
+    {
+        for (block_t *current = lists[i]; current != NULL;
+             current = *(block_t **)header_to_payload(current))
+        {
+            if (++pending_count > alloc_count)
+                return false;
+            if (!check_within_heap(a, current) || !get_alloc(current))
+                return false;
+        }
+    }
+    return true;
+}
+
+// Checks one arena's heap and free lists in a single pass over the heap
+// and its segments and one over the free lists.
+bool check_arena(arena_t *a)
 {
-    block_t *start_blk = (block_t *)mem_heap_lo();
-    block_t *end_blk = (block_t *)((char *)mem_heap_hi() - 7);
-    if (!(check_block(end_blk) && check_block(start_blk)))
+    size_t scan_limit = deep_check ? SIZE_MAX : step_scan_limit;
+
+    if (!check_block((block_t *)a->heap_lo) || !check_segments(a))
         return false;
 
     uint64_t free_blk_count = 0;
+    uint64_t alloc_blk_count = 0;
 
     // Iterates through each block in the heap to perform various checks.
-    for (block_t *current_blk = heap_listp; get_size(current_blk) > 0; current_blk = find_next(current_blk))
+    for (block_t *current_blk = a->heap_start; current_blk != NULL; current_blk = next_part(a, current_blk))
     {
-        // check for proper coalescing
-        if (!check_adj_free_blocks(current_blk))
+        size_t prev_size = 0; // the prologue counts as an allocated block
+        bool prev_alloc = true;
+        for (; get_size(current_blk) > 0; current_blk = find_next(current_blk))
         {
-            return false;
+            if (!check_heap_block(a, current_blk, prev_size, prev_alloc, scan_limit))
+                return false;
+            prev_size = get_size(current_blk);
+            prev_alloc = get_alloc(current_blk);
+
+            // Increments the count of free blocks, leaving out the wilderness
+            if (!prev_alloc && current_blk != a->wild)
+                free_blk_count++;
+            else if (prev_alloc)
+                alloc_blk_count++;
         }
+        if (!check_part_end(a, current_blk, prev_size, prev_alloc))
+            return false;
+    }
+
+    // Verifies the free list count and pointer validity
+    return check_free_list(a, free_blk_count) && check_slabs(a) &&
+           check_pending(a, alloc_blk_count) && check_clean_top(a, scan_limit);
+}
 
-        // Ensures each block is within the heap bounds
-        if (!check_within_heap(current_blk))
+// Checks up to *budget blocks of the arena's heap and segments, resuming
+// after the block the previous call stopped at, and takes what it used off
+// *budget. When the walk reaches the last epilogue the arena's segment list
+// and slab runs are checked too and the next call starts over. Sets *done
+// when that happens.
+bool check_arena_step(arena_t *a, size_t *budget, bool *done)
+{
+    block_t *prev_blk = a->check_at;
+    block_t *current_blk;
+    size_t prev_size = 0;
+    bool prev_alloc = true;
+
+    if (prev_blk == NULL)
+    {
+        if (!check_block((block_t *)a->heap_lo))
+            return false;
+        current_blk = a->heap_start;
+    }
+    else
+    {
+        if (!check_within_heap(a, prev_blk))
             return false;
+        prev_size = get_size(prev_blk);
+        prev_alloc = get_alloc(prev_blk);
+        current_blk = find_next(prev_blk);
+    }
 
-        // Checks alignment and minimum size requirements for each block.
-        if (!check_alignment_min_size(current_blk))
+    *done = false;
+    while (current_blk != NULL)
+    {
+        for (; *budget > 0 && get_size(current_blk) > 0; current_blk = find_next(current_blk))
+        {
+            if (!check_heap_block(a, current_blk, prev_size, prev_alloc, step_scan_limit))
+                return false;
+            prev_blk = current_blk;
+            prev_size = get_size(current_blk);
+            prev_alloc = get_alloc(current_blk);
+            (*budget)--;
+        }
+        a->check_at = prev_blk;
+
+        if (get_size(current_blk) > 0)
+            return true;
+
+        // Reached an epilogue; the next part, if any, starts afresh
+        if (!check_part_end(a, current_blk, prev_size, prev_alloc))
             return false;
+        current_blk = next_part(a, current_blk);
+        prev_size = 0;
+        prev_alloc = true;
+    }
+
+    a->check_at = NULL;
+    *done = true;
+    return check_segments(a) && check_slabs(a);
+}
 
-        // Increments the count of free blocks
-        if (!get_alloc(current_blk))
-            free_blk_count++;
+/* mm_checkheap: checks the heap for correctness; returns true if
+ *               the heap is correct, and false otherwise.
+ *               can call this function using mm_checkheap(__LINE__);
+ *               to identify the line number of the call site.
+ *               Free memory past the clean mark is scanned no further
+ *               than step_scan_limit bytes per block unless
+ *               mm_set_deep_check is on, so the cost follows the number
+ *               of blocks rather than the bytes in the heap.
+ */
+bool mm_checkheap(int line_number)
+{
+#ifdef MM_THREADS
+    // Check every arena that exists, each under its own lock
+    for (size_t i = 0; i < MAX_ARENAS; i++)
+    {
+        arena_t *a = arena_at(i);
+        if (a == NULL)
+            continue;
+        arena_lock(a);
+        bool ok = check_arena(a);
+        arena_unlock(a);
+        if (!ok)
+            return false;
     }
+    return true;
+#else
+    return check_arena(&main_arena);
+#endif
+}
 
-    // Verifies the free list count and pointer validity
-    if (!check_free_list(root, free_blk_count))
-        return false;
+/*
+ * mm_checkheap_step: checks the next budget blocks of the heap, picking up
+ *                    where the previous call left off and moving on to the
+ *                    next arena when one is done, so that calling it now
+ *                    and then keeps checking the whole heap at a bounded
+ *                    cost per call. Each block gets the same checks as in
+ *                    mm_checkheap, but only the free lists' links at the
+ *                    blocks it visits are followed, and free memory past
+ *                    the clean mark is scanned no further than
+ *                    step_scan_limit bytes per block. Returns true if no
+ *                    problem was found.
+ */
+bool mm_checkheap_step(size_t budget)
+{
+#ifdef MM_THREADS
+    // Arenas are visited in turn, starting with the one last left unfinished
+    static size_t check_next_arena = 0;
+    size_t i = __atomic_load_n(&check_next_arena, __ATOMIC_RELAXED);
 
-    // All checks passed
+    for (size_t visited = 0; budget > 0 && visited < MAX_ARENAS; visited++)
+    {
+        arena_t *a = arena_at(i);
+        bool done = true;
+        if (a != NULL && a->heap_start != NULL)
+        {
+            arena_lock(a);
+            bool ok = check_arena_step(a, &budget, &done);
+            arena_unlock(a);
+            if (!ok)
+                return false;
+        }
+        if (done)
+            i = (i + 1) % MAX_ARENAS;
+    }
+    __atomic_store_n(&check_next_arena, i, __ATOMIC_RELAXED);
     return true;
+#else
+    bool done;
+    return main_arena.heap_start == NULL || check_arena_step(&main_arena, &budget, &done);
+#endif
 }
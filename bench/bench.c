@@ -0,0 +1,849 @@
+/*
+ * bench.c - replays allocation traces against the allocator and scores
+ *           its throughput, memory utilization and correctness, and
+ *           generates synthetic traces.
+ *
+ * Build from the top of the repository:
+ *     cc -O2 -DDRIVER -Ibench -o mm-bench bench/bench.c bench/memlib.c 2_mm.c
+ * adding -lpthread when 2_mm.c is built with MM_THREADS.
+ *
+ * Usage:
+ *     mm-bench [-r repeats] [-c check_every] [-d interval] trace...
+ *     mm-bench -t [-r repeats] trace...
+ *     mm-bench -g pattern [-n ops] [-s seed] > file.trace
+ * where pattern is binary-tree, realloc-growth, producer-consumer or random.
+ *
+ * Each trace is replayed three times from an empty heap: once with every
+ * block filled and verified and the heap checked every check_every
+ * operations, once measuring the peak of live bytes over the peak of
+ * mm_footprint (the utilization), and repeats times timed without checks,
+ * keeping the best time. Exits with status 1 if any trace fails.
+ *
+ * With -d, every replay defers its frees to a maintenance thread that
+ * merges them every interval microseconds (mm_maintain_thread); without
+ * MM_THREADS there is no thread, and an arena merges its pending frees
+ * only when it runs short.
+ *
+ * With -t, the traces are taken together as one workload and replayed the
+ * same way under every placement policy in a grid over mm_policy_t (fit
+ * policy and bound, insertion order, split_min and growth bounds), with no
+ * check but of the heap after each trace. Each policy's throughput and mean
+ * utilization are printed, followed by the Pareto front: the policies that
+ * no other beats on both, each with the MM_POLICY setting that builds it.
+ *
+ * Trace format: one operation per line, '#' starts a comment.
+ *     a <id> <size>    malloc(size) as block id
+ *     r <id> <size>    realloc block id to size (a malloc if id is not live)
+ *     f <id>           free block id
+ * Blocks still live at the end of a trace are freed after it.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+typedef struct
+{
+    char type;   // 'a', 'r' or 'f'
+    uint32_t id; // block the operation is about
+    size_t size; // requested size, for 'a' and 'r'
+} op_t;
+
+typedef struct
+{
+    const char *name;
+    op_t *ops;
+    size_t nops;
+    uint32_t nids; // one more than the largest id
+} trace_t;
+
+/* The blocks of the trace being replayed, by id */
+static void **ptrs;
+static size_t *sizes;
+
+/* The maintenance thread's interval with -d, or 0 not to defer frees */
+static size_t defer_interval = 0;
+
+/*
+ * load_trace: reads the trace at path into t. Returns false, having said
+ *             why, if it cannot be read or is malformed.
+ */
+static bool load_trace(const char *path, trace_t *t)
+{
+    FILE *f = fopen(path, "r");
+    char line[256];
+    size_t cap = 0;
+    size_t lineno = 0;
+
+    if (f == NULL)
+    {
+        perror(path);
+        return false;
+    }
+
+    t->name = path;
+    t->ops = NULL;
+    t->nops = 0;
+    t->nids = 0;
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        op_t op = {0, 0, 0};
+        unsigned long id;
+        unsigned long long size = 0;
+        char *s = line;
+
+        lineno++;
+        while (*s == ' ' || *s == '\t')
+            s++;
+        if (*s == '#' || *s == '\n' || *s == '\0')
+            continue;
+
+        op.type = *s;
+        if ((op.type == 'a' || op.type == 'r') && sscanf(s + 1, "%lu %llu", &id, &size) == 2)
+            op.size = size;
+        else if (op.type == 'f' && sscanf(s + 1, "%lu", &id) == 1)
+            op.size = 0;
+        else
+        {
+            fprintf(stderr, "%s:%zu: bad operation\n", path, lineno);
+            fclose(f);
+            return false;
+        }
+        if (id >= UINT32_MAX)
+        {
+            fprintf(stderr, "%s:%zu: id too large\n", path, lineno);
+            fclose(f);
+            return false;
+        }
+        op.id = (uint32_t)id;
+
+        if (t->nops == cap)
+        {
+            cap = cap ? 2 * cap : 4096;
+            t->ops = realloc(t->ops, cap * sizeof(op_t));
+            if (t->ops == NULL)
+            {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        t->ops[t->nops++] = op;
+        if (op.id >= t->nids)
+            t->nids = op.id + 1;
+    }
+    fclose(f);
+    return true;
+}
+
+/*
+ * start_run: gives the allocator an empty heap and forgets every block.
+ */
+static void start_run(const trace_t *t)
+{
+    // The maintenance thread must not run across mm_init
+    if (defer_interval > 0)
+        mm_maintain_thread(0);
+    mem_reset_brk();
+    if (!mm_init())
+    {
+        fprintf(stderr, "mm_init failed\n");
+        exit(1);
+    }
+    if (defer_interval > 0 && !mm_maintain_thread(defer_interval))
+        mm_set_deferred_free(true);
+    memset(ptrs, 0, t->nids * sizeof(void *));
+    memset(sizes, 0, t->nids * sizeof(size_t));
+}
+
+/*
+ * end_run: frees the blocks the trace left live.
+ */
+static void end_run(const trace_t *t)
+{
+    for (uint32_t id = 0; id < t->nids; id++)
+    {
+        if (ptrs[id] != NULL)
+        {
+            mm_free(ptrs[id]);
+            ptrs[id] = NULL;
+        }
+    }
+}
+
+/*
+ * fill_byte: the byte that block id is filled with.
+ */
+static unsigned char fill_byte(uint32_t id)
+{
+    return (unsigned char)((id * 2654435761u) >> 24);
+}
+
+/*
+ * intact: returns true if the first n bytes of block id still hold its
+ *         fill byte.
+ */
+static bool intact(uint32_t id, size_t n)
+{
+    const unsigned char *p = ptrs[id];
+    unsigned char c = fill_byte(id);
+
+    for (size_t i = 0; i < n; i++)
+    {
+        if (p[i] != c)
+            return false;
+    }
+    return true;
+}
+
+/*
+ * check_trace: replays the trace, filling every block with a byte of its
+ *              own and verifying it before each realloc and free, so that
+ *              overlapping blocks and lost data show up. Also checks
+ *              alignment, failed allocations, and the heap itself every
+ *              check_every operations and at the end. Returns true if all
+ *              is well.
+ */
+static bool check_trace(const trace_t *t, size_t check_every)
+{
+    bool ok = true;
+
+    start_run(t);
+    for (size_t i = 0; i < t->nops && ok; i++)
+    {
+        const op_t *op = &t->ops[i];
+        const char *error = NULL;
+        void *p = NULL;
+
+        if (op->type == 'f' && ptrs[op->id] == NULL)
+            error = "free of a block that is not live";
+        else if (op->type == 'a' && ptrs[op->id] != NULL)
+            error = "malloc of a block that is already live";
+        else if (ptrs[op->id] != NULL && !intact(op->id, sizes[op->id]))
+            error = "block contents were overwritten";
+
+        if (error == NULL && op->type == 'f')
+        {
+            mm_free(ptrs[op->id]);
+            ptrs[op->id] = NULL;
+        }
+        else if (error == NULL)
+        {
+            size_t keep = (op->size < sizes[op->id]) ? op->size : sizes[op->id];
+
+            if (op->type == 'a' || ptrs[op->id] == NULL)
+                p = mm_malloc(op->size);
+            else
+                p = mm_realloc(ptrs[op->id], op->size);
+
+            if (op->size > 0 && p == NULL)
+                error = "allocation failed";
+            else if ((uintptr_t)p % 16 != 0)
+                error = "payload is not 16-byte aligned";
+            else
+            {
+                ptrs[op->id] = p;
+                sizes[op->id] = op->size;
+                if (p != NULL && !intact(op->id, keep))
+                    error = "realloc lost the block's contents";
+                else if (p != NULL)
+                    memset(p, fill_byte(op->id), op->size);
+            }
+        }
+
+        if (error == NULL && check_every > 0 && (i + 1) % check_every == 0 &&
+            !mm_checkheap(__LINE__))
+            error = "heap check failed";
+        if (error != NULL)
+        {
+            fprintf(stderr, "%s: operation %zu (%c %u): %s\n",
+                    t->name, i + 1, op->type, op->id, error);
+            ok = false;
+        }
+    }
+
+    if (ok && !mm_checkheap(__LINE__))
+    {
+        fprintf(stderr, "%s: heap check failed at the end\n", t->name);
+        ok = false;
+    }
+    end_run(t);
+    return ok;
+}
+
+/*
+ * util_trace: replays the trace and returns the peak of the live requested
+ *             bytes over the peak of the allocator's footprint.
+ */
+static double util_trace(const trace_t *t)
+{
+    size_t live = 0;
+    size_t peak_live = 0;
+    size_t peak_footprint = 0;
+
+    start_run(t);
+    for (size_t i = 0; i < t->nops; i++)
+    {
+        const op_t *op = &t->ops[i];
+        void *p = ptrs[op->id];
+
+        live -= sizes[op->id];
+        sizes[op->id] = 0;
+        if (op->type == 'f')
+        {
+            mm_free(p);
+            p = NULL;
+        }
+        else
+        {
+            p = (op->type == 'a' || p == NULL) ? mm_malloc(op->size) : mm_realloc(p, op->size);
+            sizes[op->id] = (p != NULL) ? op->size : 0;
+        }
+        ptrs[op->id] = p;
+        live += sizes[op->id];
+
+        size_t footprint = mm_footprint();
+        if (live > peak_live)
+            peak_live = live;
+        if (footprint > peak_footprint)
+            peak_footprint = footprint;
+    }
+    end_run(t);
+    return peak_footprint ? (double)peak_live / (double)peak_footprint : 0.0;
+}
+
+/*
+ * time_trace: replays the trace repeats times without any checks and
+ *             returns the shortest time taken, in seconds.
+ */
+static double time_trace(const trace_t *t, int repeats)
+{
+    double best = 0.0;
+
+    for (int r = 0; r < repeats; r++)
+    {
+        struct timespec start, end;
+
+        start_run(t);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (size_t i = 0; i < t->nops; i++)
+        {
+            const op_t *op = &t->ops[i];
+            void *p = ptrs[op->id];
+
+            if (op->type == 'f')
+            {
+                mm_free(p);
+                p = NULL;
+            }
+            else if (op->type == 'a' || p == NULL)
+                p = mm_malloc(op->size);
+            else
+                p = mm_realloc(p, op->size);
+            ptrs[op->id] = p;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        end_run(t);
+
+        double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+        if (r == 0 || secs < best)
+            best = secs;
+    }
+    return best;
+}
+
+/*
+ * score_trace: checks the trace (unless check is false, when only the heap
+ *              is checked, at the end), then measures its utilization and
+ *              its best time over repeats runs. Returns false if the check
+ *              fails.
+ */
+static bool score_trace(const trace_t *t, bool check, size_t check_every, int repeats,
+                        double *util, double *secs)
+{
+    ptrs = calloc(t->nids ? t->nids : 1, sizeof(void *));
+    sizes = calloc(t->nids ? t->nids : 1, sizeof(size_t));
+    bool ok = !check || check_trace(t, check_every);
+    *util = ok ? util_trace(t) : 0.0;
+    *secs = ok ? time_trace(t, repeats) : 0.0;
+    if (!check && !mm_checkheap(__LINE__))
+    {
+        fprintf(stderr, "%s: heap check failed at the end\n", t->name);
+        ok = false;
+    }
+    free(ptrs);
+    free(sizes);
+    return ok;
+}
+
+/*
+ * The grid the autotuner searches: each fit policy, with a few bounds for
+ * the bounded fit and allowances for the good fit, under each insertion
+ * order, split_min and pair of growth bounds.
+ */
+typedef struct
+{
+    mm_fit_t fit;
+    unsigned fit_bound;
+    unsigned good_shift;
+} fit_choice_t;
+
+static const fit_choice_t fit_choices[] = {
+    {MM_FIT_BEST, 16, 3},   {MM_FIT_FIRST, 16, 3},   {MM_FIT_NEXT, 16, 3},
+    {MM_FIT_BOUNDED, 4, 3}, {MM_FIT_BOUNDED, 16, 3}, {MM_FIT_BOUNDED, 64, 3},
+    {MM_FIT_GOOD, 16, 2},   {MM_FIT_GOOD, 16, 4},
+};
+static const size_t split_choices[] = {16, 64, 256};
+static const size_t grow_choices[][2] = {{2048, 65536}, {4096, 1 << 20}};
+
+static const char *const fit_names[] = {"MM_FIT_BEST", "MM_FIT_FIRST", "MM_FIT_NEXT",
+                                        "MM_FIT_BOUNDED", "MM_FIT_GOOD"};
+static const char *const insert_names[] = {"MM_INSERT_LIFO", "MM_INSERT_FIFO",
+                                           "MM_INSERT_ADDRESS"};
+
+#define N_FITS (sizeof(fit_choices) / sizeof(fit_choices[0]))
+#define N_SPLITS (sizeof(split_choices) / sizeof(split_choices[0]))
+#define N_GROWS (sizeof(grow_choices) / sizeof(grow_choices[0]))
+#define N_POLICIES (N_FITS * 3 * N_SPLITS * N_GROWS)
+
+typedef struct
+{
+    mm_policy_t policy;
+    double kops; // over the whole workload
+    double util; // mean over the traces
+    bool ok;
+} tuned_t;
+
+/*
+ * format_policy: writes p into buf as an initializer for MM_POLICY.
+ */
+static void format_policy(char *buf, size_t n, const mm_policy_t *p)
+{
+    snprintf(buf, n, "{%s, %s, %u, %u, %zu, %zu, %zu}", fit_names[p->fit],
+             insert_names[p->insert], p->fit_bound, p->good_shift, p->split_min,
+             p->grow_min, p->grow_max);
+}
+
+/*
+ * tune: replays the traces under every policy of the grid and reports each
+ *       one and the Pareto front of throughput and utilization. Returns
+ *       false if any policy fails a trace.
+ */
+static bool tune(const trace_t *traces, int ntraces, int repeats)
+{
+    static tuned_t results[N_POLICIES];
+    char name[128];
+    size_t n = 0;
+    bool all_ok = true;
+
+    printf("%-70s %12s %7s\n", "policy", "Kops/s", "util");
+    for (size_t f = 0; f < N_FITS; f++)
+        for (int ins = MM_INSERT_LIFO; ins <= MM_INSERT_ADDRESS; ins++)
+            for (size_t sp = 0; sp < N_SPLITS; sp++)
+                for (size_t g = 0; g < N_GROWS; g++)
+                {
+                    tuned_t *r = &results[n++];
+                    r->policy = (mm_policy_t){fit_choices[f].fit, (mm_insert_t)ins,
+                                              fit_choices[f].fit_bound, fit_choices[f].good_shift,
+                                              split_choices[sp], grow_choices[g][0],
+                                              grow_choices[g][1]};
+                    if (!mm_set_policy(&r->policy))
+                    {
+                        fprintf(stderr, "policy rejected; built with MM_POLICY?\n");
+                        return false;
+                    }
+
+                    double ops = 0.0, secs = 0.0, util = 0.0;
+                    r->ok = true;
+                    for (int i = 0; i < ntraces && r->ok; i++)
+                    {
+                        double u, s;
+                        r->ok = score_trace(&traces[i], false, 0, repeats, &u, &s);
+                        ops += traces[i].nops;
+                        secs += s;
+                        util += u;
+                    }
+                    r->kops = (r->ok && secs > 0) ? ops / secs / 1000 : 0.0;
+                    r->util = r->ok ? util / ntraces : 0.0;
+                    all_ok = all_ok && r->ok;
+
+                    format_policy(name, sizeof(name), &r->policy);
+                    printf("%-70s %12.1f %6.1f%%  %s\n", name, r->kops, r->util * 100,
+                           r->ok ? "" : "FAIL");
+                    fflush(stdout);
+                }
+
+    // A policy is on the front unless another is at least as good on both
+    // counts and better on one
+    printf("\nPareto front, by utilization:\n");
+    bool printed[N_POLICIES] = {false};
+    for (;;)
+    {
+        tuned_t *next = NULL;
+        for (size_t i = 0; i < n; i++)
+        {
+            tuned_t *r = &results[i];
+            bool dominated = !r->ok || printed[i];
+            for (size_t j = 0; j < n && !dominated; j++)
+            {
+                tuned_t *o = &results[j];
+                dominated = o->ok && o->kops >= r->kops && o->util >= r->util &&
+                            (o->kops > r->kops || o->util > r->util);
+            }
+            if (!dominated && (next == NULL || r->util > next->util))
+                next = r;
+        }
+        if (next == NULL)
+            break;
+        printed[next - results] = true;
+        format_policy(name, sizeof(name), &next->policy);
+        printf("  %12.1f Kops/s %6.1f%%  -DMM_POLICY='%s'\n", next->kops, next->util * 100, name);
+    }
+    return all_ok;
+}
+
+/* State of the trace generator */
+static uint64_t rng_state;
+static uint32_t next_id;
+static size_t emitted;
+
+/*
+ * rng: returns the next pseudo-random number (xorshift64).
+ */
+static uint64_t rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+/*
+ * log_size: returns a size between lo and hi, spread evenly over the powers
+ *           of two in between, as real request sizes tend to be.
+ */
+static size_t log_size(size_t lo, size_t hi)
+{
+    int lo_log = 63 - __builtin_clzl(lo);
+    int hi_log = 63 - __builtin_clzl(hi);
+    size_t base = (size_t)1 << (lo_log + (int)(rng() % (uint64_t)(hi_log - lo_log + 1)));
+    size_t size = base + rng() % base;
+    return (size < lo) ? lo : (size > hi) ? hi : size;
+}
+
+static uint32_t emit_alloc(size_t size)
+{
+    printf("a %u %zu\n", next_id, size);
+    emitted++;
+    return next_id++;
+}
+
+static void emit_realloc(uint32_t id, size_t size)
+{
+    printf("r %u %zu\n", id, size);
+    emitted++;
+}
+
+static void emit_free(uint32_t id)
+{
+    printf("f %u\n", id);
+    emitted++;
+}
+
+/*
+ * gen_binary_tree: builds binary trees of small nodes depth first and tears
+ *                  them down again, in reverse or in random order, while
+ *                  one tree stays alive throughout.
+ */
+static void gen_binary_tree(size_t ops)
+{
+    uint32_t *nodes = malloc(((size_t)1 << 16) * sizeof(uint32_t));
+    uint32_t *keep = NULL;
+    size_t nkeep = 0;
+
+    while (emitted < ops)
+    {
+        size_t count = ((size_t)2 << (4 + rng() % 11)) - 1; // 31 to 65535 nodes
+        for (size_t i = 0; i < count; i++)
+            nodes[i] = emit_alloc(16 + 8 * (rng() % 7));
+
+        if (keep == NULL)
+        {
+            keep = malloc(count * sizeof(uint32_t));
+            memcpy(keep, nodes, count * sizeof(uint32_t));
+            nkeep = count;
+            continue;
+        }
+
+        if (rng() % 2)
+        {
+            for (size_t i = count; i-- > 0;)
+                emit_free(nodes[i]);
+        }
+        else
+        {
+            for (size_t i = count; i > 1; i--)
+            {
+                size_t j = rng() % i;
+                uint32_t tmp = nodes[i - 1];
+                nodes[i - 1] = nodes[j];
+                nodes[j] = tmp;
+            }
+            for (size_t i = 0; i < count; i++)
+                emit_free(nodes[i]);
+        }
+    }
+
+    for (size_t i = 0; i < nkeep; i++)
+        emit_free(keep[i]);
+    free(keep);
+    free(nodes);
+}
+
+/*
+ * gen_realloc_growth: grows buffers step by step with realloc, the way
+ *                     vectors and string builders do, among short-lived
+ *                     small objects that get in their way.
+ */
+static void gen_realloc_growth(size_t ops)
+{
+    enum { nbufs = 16, nsmall = 64 };
+    uint32_t bufs[nbufs];
+    size_t buf_sizes[nbufs];
+    size_t buf_caps[nbufs];
+    uint32_t small[nsmall];
+    bool small_live[nsmall];
+
+    memset(buf_sizes, 0, sizeof(buf_sizes));
+    memset(small_live, 0, sizeof(small_live));
+    while (emitted < ops)
+    {
+        size_t b = rng() % nbufs;
+        if (buf_sizes[b] == 0)
+        {
+            buf_sizes[b] = log_size(16, 256);
+            buf_caps[b] = log_size(4096, (size_t)1 << 21);
+            bufs[b] = emit_alloc(buf_sizes[b]);
+        }
+        else if (buf_sizes[b] >= buf_caps[b])
+        {
+            emit_free(bufs[b]);
+            buf_sizes[b] = 0;
+        }
+        else
+        {
+            buf_sizes[b] += (rng() % 2) ? buf_sizes[b] / 2 : 16 + rng() % 64;
+            emit_realloc(bufs[b], buf_sizes[b]);
+        }
+
+        size_t s = rng() % nsmall;
+        if (small_live[s])
+            emit_free(small[s]);
+        else
+            small[s] = emit_alloc(log_size(16, 512));
+        small_live[s] = !small_live[s];
+    }
+
+    for (size_t b = 0; b < nbufs; b++)
+        if (buf_sizes[b] != 0)
+            emit_free(bufs[b]);
+    for (size_t s = 0; s < nsmall; s++)
+        if (small_live[s])
+            emit_free(small[s]);
+}
+
+/*
+ * gen_producer_consumer: messages of mixed sizes are allocated at the tail
+ *                        of a queue and freed from its head, so blocks die
+ *                        in the order they were born.
+ */
+static void gen_producer_consumer(size_t ops)
+{
+    enum { max_queue = 4096 };
+    uint32_t queue[max_queue];
+    size_t head = 0;
+    size_t length = 0;
+
+    while (emitted < ops)
+    {
+        if (length < max_queue && (length == 0 || rng() % 100 < 55))
+        {
+            uint64_t r = rng() % 10;
+            size_t size = (r < 5) ? log_size(16, 128) : (r < 9) ? log_size(128, 4096)
+                                                                : log_size(4096, 65536);
+            queue[(head + length++) % max_queue] = emit_alloc(size);
+        }
+        else
+        {
+            emit_free(queue[head]);
+            head = (head + 1) % max_queue;
+            length--;
+        }
+    }
+
+    for (; length > 0; length--, head = (head + 1) % max_queue)
+        emit_free(queue[head]);
+}
+
+/*
+ * gen_random: allocates, reallocates and frees at random over a bounded
+ *             set of slots, with sizes from 1 byte to 1 MiB.
+ */
+static void gen_random(size_t ops)
+{
+    enum { nslots = 8192 };
+    static uint32_t ids[nslots];
+    static bool live[nslots];
+
+    while (emitted < ops)
+    {
+        size_t s = rng() % nslots;
+        if (!live[s])
+        {
+            ids[s] = emit_alloc(log_size(1, (size_t)1 << 20));
+            live[s] = true;
+        }
+        else if (rng() % 5 == 0)
+        {
+            emit_realloc(ids[s], log_size(1, (size_t)1 << 20));
+        }
+        else
+        {
+            emit_free(ids[s]);
+            live[s] = false;
+        }
+    }
+
+    for (size_t s = 0; s < nslots; s++)
+        if (live[s])
+            emit_free(ids[s]);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: mm-bench [-r repeats] [-c check_every] [-d interval] trace...\n"
+                    "       mm-bench -t [-r repeats] trace...\n"
+                    "       mm-bench -g pattern [-n ops] [-s seed]\n"
+                    "patterns: binary-tree realloc-growth producer-consumer random\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const char *pattern = NULL;
+    size_t ops = 100000;
+    size_t check_every = 1000;
+    int repeats = 3;
+    bool tuning = false;
+    int c;
+
+    rng_state = 88172645463325252ULL;
+    while ((c = getopt(argc, argv, "g:n:s:r:c:d:t")) != -1)
+    {
+        switch (c)
+        {
+        case 'g':
+            pattern = optarg;
+            break;
+        case 'n':
+            ops = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            rng_state = strtoull(optarg, NULL, 0) | 1;
+            break;
+        case 'r':
+            repeats = atoi(optarg);
+            break;
+        case 'c':
+            check_every = strtoul(optarg, NULL, 0);
+            break;
+        case 'd':
+            defer_interval = strtoul(optarg, NULL, 0);
+            break;
+        case 't':
+            tuning = true;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (pattern != NULL)
+    {
+        printf("# %s, about %zu operations\n", pattern, ops);
+        if (strcmp(pattern, "binary-tree") == 0)
+            gen_binary_tree(ops);
+        else if (strcmp(pattern, "realloc-growth") == 0)
+            gen_realloc_growth(ops);
+        else if (strcmp(pattern, "producer-consumer") == 0)
+            gen_producer_consumer(ops);
+        else if (strcmp(pattern, "random") == 0)
+            gen_random(ops);
+        else
+            usage();
+        return 0;
+    }
+
+    if (optind == argc || repeats < 1)
+        usage();
+
+    mem_init();
+    if (tuning)
+    {
+        int ntraces = argc - optind;
+        trace_t *traces = calloc(ntraces, sizeof(trace_t));
+        bool ok = true;
+        for (int i = 0; i < ntraces && ok; i++)
+            ok = load_trace(argv[optind + i], &traces[i]);
+        ok = ok && tune(traces, ntraces, repeats);
+        for (int i = 0; i < ntraces; i++)
+            free(traces[i].ops);
+        free(traces);
+        mem_deinit();
+        return ok ? 0 : 1;
+    }
+
+    bool all_ok = true;
+    double total_ops = 0.0, total_secs = 0.0, total_util = 0.0;
+    int ntraces = 0;
+
+    printf("%-32s %10s %12s %7s  %s\n", "trace", "ops", "Kops/s", "util", "check");
+    for (int i = optind; i < argc; i++)
+    {
+        trace_t t;
+        if (!load_trace(argv[i], &t))
+        {
+            all_ok = false;
+            continue;
+        }
+
+        double util, secs;
+        bool ok = score_trace(&t, true, check_every, repeats, &util, &secs);
+
+        printf("%-32s %10zu %12.1f %6.1f%%  %s\n", t.name, t.nops,
+               secs > 0 ? t.nops / secs / 1000 : 0.0, util * 100, ok ? "ok" : "FAIL");
+        if (ok)
+        {
+            total_ops += t.nops;
+            total_secs += secs;
+            total_util += util;
+            ntraces++;
+        }
+        all_ok = all_ok && ok;
+        free(t.ops);
+    }
+
+    if (ntraces > 0)
+        printf("%-32s %10.0f %12.1f %6.1f%%  %s\n", "total", total_ops,
+               total_secs > 0 ? total_ops / total_secs / 1000 : 0.0,
+               total_util / ntraces * 100, all_ok ? "ok" : "FAIL");
+    if (defer_interval > 0)
+        mm_maintain_thread(0);
+    mem_deinit();
+    return all_ok ? 0 : 1;
+}
@@ -0,0 +1,127 @@
+/*
+ * memlib.c - a simulated memory system for the allocator.
+ *
+ * mem_init reserves max_heap bytes of address space without committing
+ * them, aligned to a huge page; pages are only backed once the allocator
+ * touches them. The heap never shrinks: mem_sbrk rejects negative
+ * increments, as the allocator expects.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "memlib.h"
+
+static const size_t max_heap = (size_t)1 << 32; // reserved heap bytes
+static const size_t heap_align = (size_t)1 << 21; // a huge page, so the heap can use them
+
+static char *heap_lo = NULL; // first byte of the heap
+static char *heap_brk = NULL; // one past the last byte of the heap
+
+/*
+ * mem_init: reserves the heap, aligned to heap_align. Exits if the
+ *           reservation fails.
+ */
+void mem_init(void)
+{
+    char *raw = mmap(NULL, max_heap + heap_align, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (raw == MAP_FAILED)
+    {
+        perror("mem_init: mmap");
+        exit(1);
+    }
+
+    // Keep the aligned part of the reservation only
+    heap_lo = (char *)(((uintptr_t)raw + heap_align - 1) & ~(uintptr_t)(heap_align - 1));
+    if (heap_lo > raw)
+        munmap(raw, heap_lo - raw);
+    munmap(heap_lo + max_heap, raw + heap_align - heap_lo);
+    heap_brk = heap_lo;
+}
+
+/*
+ * mem_deinit: gives the heap back to the system.
+ */
+void mem_deinit(void)
+{
+    munmap(heap_lo, max_heap);
+    heap_lo = NULL;
+    heap_brk = NULL;
+}
+
+/*
+ * mem_sbrk: grows the heap by incr bytes and returns the old break, or
+ *           (void *)-1 with errno set to ENOMEM.
+ */
+void *mem_sbrk(intptr_t incr)
+{
+    char *old_brk = heap_brk;
+
+    if (incr < 0 || (size_t)incr > max_heap - (size_t)(heap_brk - heap_lo))
+    {
+        errno = ENOMEM;
+        return (void *)-1;
+    }
+    heap_brk += incr;
+    return old_brk;
+}
+
+/*
+ * mem_reset_brk: empties the heap, keeping its contents.
+ */
+void mem_reset_brk(void)
+{
+    heap_brk = heap_lo;
+}
+
+/*
+ * mem_heap_lo: returns the first byte of the heap.
+ */
+void *mem_heap_lo(void)
+{
+    return heap_lo;
+}
+
+/*
+ * mem_heap_hi: returns the last byte of the heap.
+ */
+void *mem_heap_hi(void)
+{
+    return heap_brk - 1;
+}
+
+/*
+ * mem_heapsize: returns the heap size in bytes.
+ */
+size_t mem_heapsize(void)
+{
+    return heap_brk - heap_lo;
+}
+
+/*
+ * mem_pagesize: returns the system page size in bytes.
+ */
+size_t mem_pagesize(void)
+{
+    return (size_t)getpagesize();
+}
+
+/*
+ * mem_memset: memset, for the allocator's own use.
+ */
+void *mem_memset(void *ptr, int value, size_t n)
+{
+    return memset(ptr, value, n);
+}
+
+/*
+ * mem_memcpy: memcpy, for the allocator's own use.
+ */
+void *mem_memcpy(void *dst, const void *src, size_t n)
+{
+    return memcpy(dst, src, n);
+}
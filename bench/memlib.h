@@ -0,0 +1,25 @@
+/*
+ * memlib.h - a simulated memory system for the allocator.
+ *
+ * The heap is one large reservation that mem_sbrk hands out from the
+ * bottom up. Memory past the highest break ever reached is zero-filled;
+ * mem_reset_brk moves the break back to the start without clearing.
+ */
+#ifndef MEMLIB_H
+#define MEMLIB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+void mem_init(void);
+void mem_deinit(void);
+void *mem_sbrk(intptr_t incr);
+void mem_reset_brk(void);
+void *mem_heap_lo(void);
+void *mem_heap_hi(void);
+size_t mem_heapsize(void);
+size_t mem_pagesize(void);
+void *mem_memset(void *ptr, int value, size_t n);
+void *mem_memcpy(void *dst, const void *src, size_t n);
+
+#endif /* MEMLIB_H */
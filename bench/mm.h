@@ -0,0 +1,88 @@
+/*
+ * mm.h - the allocator's interface, as built with -DDRIVER.
+ */
+#ifndef MM_H
+#define MM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+bool mm_init(void);
+void *mm_malloc(size_t size);
+void mm_free(void *ptr);
+void *mm_realloc(void *ptr, size_t size);
+void *mm_calloc(size_t nmemb, size_t size);
+bool mm_checkheap(int lineno);
+bool mm_checkheap_step(size_t budget);
+
+/*
+ * Placement policy, see mm_set_policy. The fit policy picks among the free
+ * blocks of a range class (513 bytes to 4 KiB); insertion orders every
+ * free list.
+ */
+typedef enum
+{
+    MM_FIT_BEST,    // address-ordered best fit, through the packed index
+    MM_FIT_FIRST,   // first block on the list that is large enough
+    MM_FIT_NEXT,    // first fit, resuming where the last search ended
+    MM_FIT_BOUNDED, // best of the first fit_bound blocks on the list
+    MM_FIT_GOOD     // first block within asize >> good_shift of asize
+} mm_fit_t;
+
+typedef enum
+{
+    MM_INSERT_LIFO,   // freed blocks go to the front of their list
+    MM_INSERT_FIFO,   // to the back
+    MM_INSERT_ADDRESS // in address order
+} mm_insert_t;
+
+typedef struct
+{
+    mm_fit_t fit;
+    mm_insert_t insert;
+    unsigned fit_bound;  // blocks MM_FIT_BOUNDED looks at
+    unsigned good_shift; // MM_FIT_GOOD's allowance, as a shift of the size
+    size_t split_min;    // least remainder split off a block
+    size_t grow_min;     // least heap growth, doubling up to grow_max
+    size_t grow_max;
+} mm_policy_t;
+
+bool mm_set_policy(const mm_policy_t *policy);
+void mm_get_policy(mm_policy_t *policy);
+void mm_set_mmap_threshold(size_t size);
+void mm_set_trim_threshold(size_t size);
+void mm_set_deferred_free(bool on);
+void mm_set_deep_check(bool on);
+int mm_trim(size_t pad);
+size_t mm_maintain(size_t budget);
+bool mm_maintain_thread(size_t interval);
+void *mm_memalign(size_t alignment, size_t size);
+void *mm_aligned_alloc(size_t alignment, size_t size);
+int mm_posix_memalign(void **memptr, size_t alignment, size_t size);
+size_t mm_usable_size(void *ptr);
+void mm_free_sized(void *ptr, size_t size);
+void mm_free_aligned_sized(void *ptr, size_t alignment, size_t size);
+size_t mm_malloc_batch(size_t size, size_t n, void **ptrs);
+void mm_free_batch(void **ptrs, size_t n);
+void mm_stats(FILE *stream, bool json);
+size_t mm_footprint(void);
+size_t mm_hugepages(void);
+
+typedef struct handle handle_t;
+handle_t *mm_halloc(size_t size);
+void *mm_hlock(handle_t *h);
+void mm_hunlock(handle_t *h);
+void mm_hfree(handle_t *h);
+size_t mm_compact(void);
+
+typedef struct region region_t;
+region_t *mm_region_create(size_t size);
+void *mm_region_alloc(region_t *r, size_t size);
+void mm_region_reset(region_t *r);
+void mm_region_destroy(region_t *r);
+void mm_profile_rate(size_t rate);
+void mm_profile_dump(FILE *stream, bool live);
+void mm_profile_dump_pprof(FILE *stream);
+
+#endif /* MM_H */
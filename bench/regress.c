@@ -0,0 +1,293 @@
+/*
+ * regress.c - regression tests for allocator bugs that trace replays do
+ *             not reach, such as those that only show in an extra arena.
+ *
+ * Build from the top of the repository:
+ *     cc -O2 -DDRIVER -DMM_THREADS -Ibench -o mm-regress bench/regress.c bench/memlib.c 2_mm.c -lpthread
+ *
+ * Each test prints its name and ok or FAIL; exits with status 1 if any
+ * test fails.
+ */
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+/* The C library's own sysconf, which glibc also exports under this name */
+long __sysconf(int name);
+
+/*
+ * sysconf: reports four processors online, whatever the machine has, so
+ *          that the allocator gives every new thread an extra arena even
+ *          on a single CPU. Everything else is the C library's answer.
+ */
+long sysconf(int name)
+{
+    return (name == _SC_NPROCESSORS_ONLN) ? 4 : __sysconf(name);
+}
+
+/*
+ * run_in_thread: runs test on a new thread, which gets an extra arena of
+ *                its own, and returns its result.
+ */
+static bool run_in_thread(void *(*test)(void *))
+{
+    pthread_t thread;
+    void *result = NULL;
+
+    if (pthread_create(&thread, NULL, test, NULL) != 0)
+        return false;
+    pthread_join(thread, &result);
+    return result != NULL;
+}
+
+/*
+ * calloc_after_trim: an extra arena that lowers its break must not leave
+ * the old top's data in the partial page at the old break, since calloc
+ * takes memory past the clean mark as zero once the heap grows back.
+ */
+static void *calloc_after_trim(void *arg)
+{
+    enum { n = 2000 };
+    static void *ptrs[n];
+    bool ok = true;
+
+    (void)arg;
+    for (size_t i = 0; i < n; i++)
+    {
+        ptrs[i] = mm_malloc(1000);
+        if (ptrs[i] == NULL)
+            return NULL;
+        memset(ptrs[i], 0xfa, 1000);
+    }
+    for (size_t i = n; i-- > 0;)
+        mm_free(ptrs[i]);
+    ok = mm_checkheap(__LINE__);
+
+    size_t got = 0;
+    for (; got < n && ok; got++)
+    {
+        unsigned char *p = mm_calloc(1, 1368);
+        ok = (p != NULL);
+        for (size_t j = 0; ok && j < 1368; j++)
+            ok = (p[j] == 0);
+        ptrs[got] = p;
+    }
+    ok = ok && mm_checkheap(__LINE__);
+    for (size_t i = 0; i < got; i++)
+        mm_free(ptrs[i]);
+    return ok ? ptrs : NULL;
+}
+
+/*
+ * slab_release: a slab run whose slots are all freed, while its class has
+ * other runs, must give its page back to the OS.
+ */
+static bool test_slab_release(void)
+{
+    enum { n = 20000 };
+    static void *ptrs[n];
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t pages = 0, resident = 0;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        ptrs[i] = mm_malloc(16);
+        if (ptrs[i] == NULL)
+            return false;
+        memset(ptrs[i], 0xfa, 16);
+    }
+    for (size_t i = n; i-- > 0;)
+        mm_free(ptrs[i]);
+
+    // Count the distinct pages the slots were in, and those still resident;
+    // a few may be kept by the class's last run and the thread cache
+    for (size_t i = 0; i < n; i++)
+    {
+        char *p = (char *)((uintptr_t)ptrs[i] & ~(uintptr_t)(page - 1));
+        if (i > 0 && p == (char *)((uintptr_t)ptrs[i - 1] & ~(uintptr_t)(page - 1)))
+            continue;
+        unsigned char in_core = 0;
+        if (mincore(p, page, &in_core) != 0)
+            return false;
+        pages++;
+        resident += in_core & 1;
+    }
+    return pages > 16 && resident <= 4 && mm_checkheap(__LINE__);
+}
+
+/*
+ * free_sized_tail: with a split_min above dsize, a block may keep a tail
+ * that puts it in a larger class than the size it was asked for, so
+ * mm_free_sized must not file it in the thread cache by that size.
+ */
+static bool test_free_sized_tail(void)
+{
+    mm_policy_t policy, saved;
+    bool ok;
+
+    mm_get_policy(&saved);
+    policy = saved;
+    policy.split_min = 64;
+    mem_reset_brk();
+    if (!mm_set_policy(&policy) || !mm_init())
+        return false;
+
+    // A free block of 160 bytes, fenced off from the wilderness, that a
+    // request of 100 bytes takes whole; the batch free skips the cache
+    void *a = mm_malloc(150);
+    void *fence = mm_malloc(500);
+    mm_free_batch(&a, 1);
+    void *q = mm_malloc(100);
+    ok = (q != NULL && mm_usable_size(q) >= 150);
+
+    // Another request of 100 bytes must not be handed the larger block
+    mm_free_sized(q, 100);
+    void *r = mm_malloc(100);
+    ok = ok && r != NULL && mm_usable_size(r) < 150 && mm_checkheap(__LINE__);
+    mm_free(r);
+    mm_free(fence);
+
+    mem_reset_brk();
+    return mm_set_policy(&saved) && mm_init() && ok;
+}
+
+/*
+ * compact_segment: compaction must reach the segments an arena maps once
+ * its reservation is full, and give back the free space it gathers there.
+ */
+static void *compact_segment(void *arg)
+{
+    enum { n = 1500, size = 60000 };
+    static handle_t *hs[n];
+    const uintptr_t mask = ~(uintptr_t)((1 << 26) - 1);
+    uintptr_t home = 0;
+    size_t first = n, last = n;
+    bool ok = true;
+
+    (void)arg;
+    for (size_t i = 0; i < n; i++)
+    {
+        hs[i] = mm_halloc(size);
+        if (hs[i] == NULL)
+            return NULL;
+        char *p = mm_hlock(hs[i]);
+        memset(p, (int)(i & 0xff), size);
+        if (i == 0)
+            home = (uintptr_t)p & mask;
+        else if (first == n && ((uintptr_t)p & mask) != home)
+            first = i;
+        mm_hunlock(hs[i]);
+    }
+    if (first == n)
+        ok = false;
+
+    // Free the lower half of the segment's blocks, leaving the rest above a
+    // hole that only compaction can close
+    else
+    {
+        last = first + (n - first) / 2;
+        for (size_t i = first; i < last; i++)
+        {
+            mm_hfree(hs[i]);
+            hs[i] = NULL;
+        }
+        ok = mm_compact() >= (last - first) * size / 2 && mm_checkheap(__LINE__);
+    }
+
+    for (size_t i = 0; i < n; i++)
+    {
+        if (hs[i] == NULL)
+            continue;
+        unsigned char *p = mm_hlock(hs[i]);
+        ok = ok && p[0] == (i & 0xff) && p[size - 1] == (i & 0xff);
+        mm_hunlock(hs[i]);
+        mm_hfree(hs[i]);
+    }
+    return (ok && mm_checkheap(__LINE__)) ? hs : NULL;
+}
+
+#ifndef DEBUG
+/*
+ * unbalanced_unlock: an mm_hunlock with no lock held must not leave the
+ * handle pinned, so compaction still moves its block down into a hole.
+ * A DEBUG build asserts on the unbalanced unlock instead.
+ */
+static bool test_unbalanced_unlock(void)
+{
+    handle_t *hole = mm_halloc(1000);
+    handle_t *h = mm_halloc(1000);
+    if (hole == NULL || h == NULL)
+        return false;
+
+    char *before = mm_hlock(h);
+    memset(before, 0x5a, 1000);
+    mm_hunlock(h);
+    mm_hunlock(h);
+    mm_hfree(hole);
+    mm_compact();
+
+    unsigned char *after = mm_hlock(h);
+    bool ok = (char *)after < before && after[0] == 0x5a && after[999] == 0x5a;
+    mm_hunlock(h);
+    mm_hfree(h);
+    return ok && mm_checkheap(__LINE__);
+}
+#endif
+
+typedef struct
+{
+    const char *name;
+    bool (*run)(void);
+} test_t;
+
+static bool test_calloc_after_trim(void)
+{
+    return run_in_thread(calloc_after_trim);
+}
+
+static bool test_compact_segment(void)
+{
+    return run_in_thread(compact_segment);
+}
+
+static const test_t tests[] = {
+    {"calloc-after-trim", test_calloc_after_trim},
+    {"slab-release", test_slab_release},
+    {"free-sized-tail", test_free_sized_tail},
+    {"compact-segment", test_compact_segment},
+#ifndef DEBUG
+    {"unbalanced-unlock", test_unbalanced_unlock},
+#endif
+};
+
+int main(void)
+{
+    bool all_ok = true;
+
+    mem_init();
+    if (!mm_init())
+    {
+        fprintf(stderr, "mm_init failed\n");
+        return 1;
+    }
+    // The main thread takes the main arena, so later threads get extra ones
+    mm_free(mm_malloc(1));
+    // The heaps here are small, so the checker can afford to scan them whole
+    mm_set_deep_check(true);
+
+    for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++)
+    {
+        bool ok = tests[i].run();
+        printf("%-32s %s\n", tests[i].name, ok ? "ok" : "FAIL");
+        all_ok = all_ok && ok;
+    }
+    mem_deinit();
+    return all_ok ? 0 : 1;
+}
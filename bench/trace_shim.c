@@ -0,0 +1,432 @@
+/*
+ * trace_shim.c - records the allocations of a real program as a trace that
+ *                mm-bench can replay.
+ *
+ * Build and use:
+ *     cc -O2 -shared -fPIC -o libmmtrace.so bench/trace_shim.c -ldl -lpthread
+ *     MM_TRACE=prog.trace LD_PRELOAD=./libmmtrace.so prog args...
+ *
+ * malloc, calloc, realloc, free and the aligned allocation functions are
+ * passed on to the next allocator in line (normally libc's) and logged in
+ * the trace format described in bench.c, with every pointer given an id of
+ * its own. calloc is logged as a malloc and alignment is dropped, since the
+ * trace only carries sizes. The trace goes to MM_TRACE, or mm.trace by
+ * default. Calls made from several threads are serialized into one trace.
+ */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static void *(*real_malloc)(size_t);
+static void *(*real_calloc)(size_t, size_t);
+static void *(*real_realloc)(void *, size_t);
+static void (*real_free)(void *);
+static int (*real_posix_memalign)(void **, size_t, size_t);
+static void *(*real_aligned_alloc)(size_t, size_t);
+static void *(*real_memalign)(size_t, size_t);
+
+/*
+ * dlsym may itself allocate before the real functions are known; those
+ * requests are carved out of this buffer and never freed.
+ */
+static char bootstrap[8192] __attribute__((aligned(16)));
+static size_t bootstrap_used = 0;
+
+/*
+ * The id of every live pointer, in an open-addressing hash table mapped
+ * straight from the OS so that it never calls back into malloc. Freed
+ * slots are left as tombstones until the table is rebuilt.
+ */
+typedef struct
+{
+    void *ptr;   // NULL if the slot is empty, tombstone if it was freed
+    uint32_t id;
+} slot_t;
+
+static slot_t *table = NULL;
+static size_t table_cap = 0;
+static size_t table_used = 0; // live entries and tombstones
+static uint32_t next_id = 0;
+static void *const tombstone = (void *)1;
+
+/* Trace output, buffered and written with write(2) */
+static int trace_fd = -1;
+static char out[1 << 16];
+static size_t out_used = 0;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread bool busy = false; // this thread is inside the shim
+
+/*
+ * resolve: looks up the real allocation functions.
+ */
+static void resolve(void)
+{
+    static __thread bool resolving = false;
+
+    if (resolving)
+        return;
+    resolving = true;
+    real_malloc = dlsym(RTLD_NEXT, "malloc");
+    real_calloc = dlsym(RTLD_NEXT, "calloc");
+    real_realloc = dlsym(RTLD_NEXT, "realloc");
+    real_free = dlsym(RTLD_NEXT, "free");
+    real_posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
+    real_aligned_alloc = dlsym(RTLD_NEXT, "aligned_alloc");
+    real_memalign = dlsym(RTLD_NEXT, "memalign");
+    resolving = false;
+}
+
+/*
+ * bootstrap_alloc: serves an allocation made while resolving.
+ */
+static void *bootstrap_alloc(size_t size)
+{
+    size = (size + 15) & ~(size_t)15;
+    if (size > sizeof(bootstrap) - bootstrap_used)
+        return NULL;
+    void *p = bootstrap + bootstrap_used;
+    bootstrap_used += size;
+    return p;
+}
+
+static bool from_bootstrap(void *p)
+{
+    return (char *)p >= bootstrap && (char *)p < bootstrap + sizeof(bootstrap);
+}
+
+/*
+ * flush: writes out the buffered trace.
+ */
+static void flush(void)
+{
+    size_t done = 0;
+
+    while (done < out_used)
+    {
+        ssize_t n = write(trace_fd, out + done, out_used - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += (size_t)n;
+    }
+    out_used = 0;
+}
+
+/*
+ * emit: appends one operation to the trace, opening it on first use.
+ */
+static void emit(char type, uint32_t id, size_t size)
+{
+    if (trace_fd == -1)
+    {
+        const char *path = getenv("MM_TRACE");
+        trace_fd = open(path ? path : "mm.trace", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (trace_fd == -1)
+            trace_fd = -2; // don't try again
+    }
+    if (trace_fd < 0)
+        return;
+
+    if (sizeof(out) - out_used < 64)
+        flush();
+    if (type == 'f')
+        out_used += (size_t)snprintf(out + out_used, sizeof(out) - out_used, "f %u\n", id);
+    else
+        out_used += (size_t)snprintf(out + out_used, sizeof(out) - out_used, "%c %u %zu\n", type, id, size);
+}
+
+static size_t hash(void *p)
+{
+    return (size_t)(((uintptr_t)p >> 4) * 0x9E3779B97F4A7C15ULL);
+}
+
+/*
+ * grow_table: rebuilds the table, doubling it if it is more than a quarter
+ *             full of live entries, and dropping the tombstones.
+ */
+static bool grow_table(void)
+{
+    size_t live = 0;
+    for (size_t i = 0; i < table_cap; i++)
+        if (table[i].ptr != NULL && table[i].ptr != tombstone)
+            live++;
+
+    size_t cap = table_cap ? table_cap : 4096;
+    if (live * 4 >= cap)
+        cap *= 2;
+    slot_t *t = mmap(NULL, cap * sizeof(slot_t), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (t == MAP_FAILED)
+        return false;
+
+    for (size_t i = 0; i < table_cap; i++)
+    {
+        if (table[i].ptr == NULL || table[i].ptr == tombstone)
+            continue;
+        size_t j = hash(table[i].ptr) & (cap - 1);
+        while (t[j].ptr != NULL)
+            j = (j + 1) & (cap - 1);
+        t[j] = table[i];
+    }
+    if (table != NULL)
+        munmap(table, table_cap * sizeof(slot_t));
+    table = t;
+    table_cap = cap;
+    table_used = live;
+    return true;
+}
+
+/*
+ * record_alloc: gives the new block p an id and logs its allocation.
+ */
+static void record_alloc(void *p, size_t size)
+{
+    if (p == NULL)
+        return;
+    if ((table_used + 1) * 2 > table_cap && !grow_table())
+        return;
+
+    size_t j = hash(p) & (table_cap - 1);
+    while (table[j].ptr != NULL)
+        j = (j + 1) & (table_cap - 1);
+    table[j].ptr = p;
+    table[j].id = next_id++;
+    table_used++;
+    emit('a', table[j].id, size);
+}
+
+/*
+ * find: returns the slot of live pointer p, or NULL if it is not known.
+ */
+static slot_t *find(void *p)
+{
+    if (table_cap == 0)
+        return NULL;
+    for (size_t j = hash(p) & (table_cap - 1); table[j].ptr != NULL; j = (j + 1) & (table_cap - 1))
+        if (table[j].ptr == p)
+            return &table[j];
+    return NULL;
+}
+
+/*
+ * record_free: logs the free of p and forgets it.
+ */
+static void record_free(void *p)
+{
+    slot_t *s = find(p);
+    if (s == NULL)
+        return;
+    emit('f', s->id, 0);
+    s->ptr = tombstone;
+}
+
+/*
+ * record_realloc: logs the move of old to p (of the new size), keeping the
+ *                 block's id.
+ */
+static void record_realloc(void *old, void *p, size_t size)
+{
+    slot_t *s = find(old);
+
+    if (s == NULL)
+    {
+        record_alloc(p, size);
+        return;
+    }
+    if (p == NULL)
+    {
+        // a failed realloc leaves the block alone; a realloc to 0 frees it
+        if (size == 0)
+            record_free(old);
+        return;
+    }
+
+    uint32_t id = s->id;
+    emit('r', id, size);
+    if (p != old)
+    {
+        s->ptr = tombstone;
+        if ((table_used + 1) * 2 > table_cap && !grow_table())
+            return;
+        size_t j = hash(p) & (table_cap - 1);
+        while (table[j].ptr != NULL)
+            j = (j + 1) & (table_cap - 1);
+        table[j].ptr = p;
+        table[j].id = id;
+        table_used++;
+    }
+}
+
+/*
+ * enter: returns true if the call should be recorded, taking the lock
+ *        for the whole call so that the trace sees addresses handed out
+ *        and returned in the order the allocator did; calls the real
+ *        allocator makes back into the shim are not recorded.
+ */
+static bool enter(void)
+{
+    if (busy)
+        return false;
+    busy = true;
+    pthread_mutex_lock(&lock);
+    return true;
+}
+
+static void leave(void)
+{
+    pthread_mutex_unlock(&lock);
+    busy = false;
+}
+
+void *malloc(size_t size)
+{
+    if (real_malloc == NULL)
+        resolve();
+    if (real_malloc == NULL)
+        return bootstrap_alloc(size);
+
+    bool record = enter();
+    void *p = real_malloc(size);
+    if (record)
+    {
+        record_alloc(p, size);
+        leave();
+    }
+    return p;
+}
+
+void *calloc(size_t n, size_t size)
+{
+    if (real_calloc == NULL)
+        resolve();
+    if (real_calloc == NULL)
+    {
+        // bootstrap memory is static, so already zero
+        if (size != 0 && n > SIZE_MAX / size)
+            return NULL;
+        return bootstrap_alloc(n * size);
+    }
+
+    bool record = enter();
+    void *p = real_calloc(n, size);
+    if (record)
+    {
+        record_alloc(p, n * size);
+        leave();
+    }
+    return p;
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    if (real_realloc == NULL)
+        resolve();
+    if (from_bootstrap(ptr) || real_realloc == NULL)
+    {
+        // bootstrap blocks don't know their size; copy what can be there
+        void *p = (real_malloc != NULL) ? real_malloc(size) : bootstrap_alloc(size);
+        if (p != NULL && ptr != NULL)
+        {
+            size_t avail = (size_t)(bootstrap + sizeof(bootstrap) - (char *)ptr);
+            memcpy(p, ptr, (size < avail) ? size : avail);
+        }
+        return p;
+    }
+
+    bool record = enter();
+    void *p = real_realloc(ptr, size);
+    if (record)
+    {
+        record_realloc(ptr, p, size);
+        leave();
+    }
+    return p;
+}
+
+void free(void *ptr)
+{
+    if (ptr == NULL || from_bootstrap(ptr))
+        return;
+    if (real_free == NULL)
+        resolve();
+
+    bool record = enter();
+    real_free(ptr);
+    if (record)
+    {
+        record_free(ptr);
+        leave();
+    }
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    if (real_posix_memalign == NULL)
+        resolve();
+
+    bool record = enter();
+    int result = real_posix_memalign(memptr, alignment, size);
+    if (record)
+    {
+        if (result == 0)
+            record_alloc(*memptr, size);
+        leave();
+    }
+    return result;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    if (real_aligned_alloc == NULL)
+        resolve();
+
+    bool record = enter();
+    void *p = real_aligned_alloc(alignment, size);
+    if (record)
+    {
+        record_alloc(p, size);
+        leave();
+    }
+    return p;
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+    if (real_memalign == NULL)
+        resolve();
+
+    bool record = enter();
+    void *p = real_memalign(alignment, size);
+    if (record)
+    {
+        record_alloc(p, size);
+        leave();
+    }
+    return p;
+}
+
+/*
+ * finish: writes out what is left of the trace when the program exits.
+ */
+__attribute__((destructor)) static void finish(void)
+{
+    pthread_mutex_lock(&lock);
+    if (trace_fd >= 0)
+    {
+        flush();
+        close(trace_fd);
+        trace_fd = -2;
+    }
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,202 @@
+/*
+ * memlib.c - the memory system of the production build, on real virtual
+ *            memory.
+ *
+ * Build the allocator as a drop-in replacement for the C library's, and
+ * preload it into any dynamically linked program:
+ *     cc -O2 -shared -fPIC -DMM_THREADS -ftls-model=initial-exec -Ibench \
+ *        -o libmm.so 2_mm.c lib/memlib.c -lpthread
+ *     LD_PRELOAD=./libmm.so prog args...
+ *
+ * The heap is one reservation of address space, made on the first mem_sbrk
+ * with no access and no swap charged to it, and aligned to a huge page.
+ * mem_sbrk commits it in steps of commit_step bytes as the break passes
+ * them, so the kernel accounts only for what the heap has reached. The
+ * reservation is MM_HEAP_RESERVE bytes (a number with an optional K, M or G
+ * suffix), default_reserve by default; if that much address space cannot be
+ * had, it is halved until it can. Nothing here calls malloc or needs the C
+ * library to be set up, since the first allocation may come from the
+ * dynamic linker or from a constructor before main.
+ */
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "memlib.h"
+
+static const size_t default_reserve = (size_t)1 << 32; // reserved heap bytes
+static const size_t min_reserve = (size_t)1 << 24;     // smallest reservation tried
+static const size_t commit_step = (size_t)1 << 20;     // bytes committed at a time
+static const size_t heap_align = (size_t)1 << 21;      // a huge page, so the heap can use them
+
+static char *heap_lo = NULL;        // first byte of the heap
+static char *heap_brk = NULL;       // one past the last byte of the heap
+static char *heap_committed = NULL; // one past the last committed byte
+static size_t heap_reserved = 0;    // bytes reserved at heap_lo
+
+/*
+ * reserve_size: returns the reservation MM_HEAP_RESERVE asks for, or
+ *               default_reserve if it is unset or malformed.
+ */
+static size_t reserve_size(void)
+{
+    const char *s = getenv("MM_HEAP_RESERVE");
+    size_t n = 0;
+
+    if (s == NULL || *s < '0' || *s > '9')
+        return default_reserve;
+    for (; *s >= '0' && *s <= '9'; s++)
+    {
+        if (n > (SIZE_MAX - 9) / 10)
+            return default_reserve;
+        n = n * 10 + (size_t)(*s - '0');
+    }
+
+    unsigned shift = 0;
+    switch (*s)
+    {
+    case 'k': case 'K': shift = 10; s++; break;
+    case 'm': case 'M': shift = 20; s++; break;
+    case 'g': case 'G': shift = 30; s++; break;
+    }
+    if (*s != '\0' || n > SIZE_MAX >> shift)
+        return default_reserve;
+    n <<= shift;
+    return (n < min_reserve) ? min_reserve : n;
+}
+
+/*
+ * mem_init: reserves the heap, if it is not reserved already. If no
+ *           reservation can be made, the heap stays empty and every
+ *           mem_sbrk fails.
+ */
+void mem_init(void)
+{
+    if (heap_lo != NULL)
+        return;
+
+    size_t page = mem_pagesize();
+    size_t size = (reserve_size() + page - 1) & ~(page - 1);
+    for (; size >= min_reserve; size /= 2)
+    {
+        char *raw = mmap(NULL, size + heap_align, PROT_NONE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (raw != MAP_FAILED)
+        {
+            // Keep the aligned part of the reservation only
+            char *lo = (char *)(((uintptr_t)raw + heap_align - 1) & ~(uintptr_t)(heap_align - 1));
+            if (lo > raw)
+                munmap(raw, lo - raw);
+            munmap(lo + size, raw + heap_align - lo);
+            heap_lo = heap_brk = heap_committed = lo;
+            heap_reserved = size;
+            return;
+        }
+    }
+}
+
+/*
+ * mem_deinit: gives the heap back to the system.
+ */
+void mem_deinit(void)
+{
+    if (heap_lo != NULL)
+        munmap(heap_lo, heap_reserved);
+    heap_lo = heap_brk = heap_committed = NULL;
+    heap_reserved = 0;
+}
+
+/*
+ * mem_sbrk: grows the heap by incr bytes, committing memory up to the new
+ *           break, and returns the old break, or (void *)-1 with errno set
+ *           to ENOMEM.
+ */
+void *mem_sbrk(intptr_t incr)
+{
+    if (heap_lo == NULL)
+        mem_init();
+
+    char *old_brk = heap_brk;
+    size_t used = (size_t)(heap_brk - heap_lo);
+
+    if (heap_lo == NULL || incr < 0 || (size_t)incr > heap_reserved - used)
+    {
+        errno = ENOMEM;
+        return (void *)-1;
+    }
+
+    size_t want = used + (size_t)incr;
+    size_t committed = (size_t)(heap_committed - heap_lo);
+    if (want > committed)
+    {
+        size_t upto = (want + commit_step - 1) / commit_step * commit_step;
+        if (upto > heap_reserved)
+            upto = heap_reserved;
+        if (mprotect(heap_committed, upto - committed, PROT_READ | PROT_WRITE) != 0)
+        {
+            errno = ENOMEM;
+            return (void *)-1;
+        }
+        heap_committed = heap_lo + upto;
+    }
+    heap_brk += incr;
+    return old_brk;
+}
+
+/*
+ * mem_reset_brk: empties the heap, keeping its contents and its commitment.
+ */
+void mem_reset_brk(void)
+{
+    heap_brk = heap_lo;
+}
+
+/*
+ * mem_heap_lo: returns the first byte of the heap.
+ */
+void *mem_heap_lo(void)
+{
+    return heap_lo;
+}
+
+/*
+ * mem_heap_hi: returns the last byte of the heap.
+ */
+void *mem_heap_hi(void)
+{
+    return heap_brk - 1;
+}
+
+/*
+ * mem_heapsize: returns the heap size in bytes.
+ */
+size_t mem_heapsize(void)
+{
+    return heap_brk - heap_lo;
+}
+
+/*
+ * mem_pagesize: returns the system page size in bytes.
+ */
+size_t mem_pagesize(void)
+{
+    return (size_t)getpagesize();
+}
+
+/*
+ * mem_memset: memset, for the allocator's own use.
+ */
+void *mem_memset(void *ptr, int value, size_t n)
+{
+    return memset(ptr, value, n);
+}
+
+/*
+ * mem_memcpy: memcpy, for the allocator's own use.
+ */
+void *mem_memcpy(void *dst, const void *src, size_t n)
+{
+    return memcpy(dst, src, n);
+}